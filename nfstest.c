@@ -1,7 +1,7 @@
 /*
    Compile:
 
-   gcc nfstest.c -o nfstest -g -Wall -W
+   gcc nfstest.c -o nfstest -g -Wall -W -pthread
 
    On machine 1 use:
 
@@ -16,6 +16,119 @@
 
    The test file must not be in the current directory, or the test will fail
    in rmdir(".").
+
+   Both roles can also be run on a single machine, as two processes
+   connected with a socketpair:
+
+   ./nfstest -local [-server-path <path>] <path> [<commands>]
+
+   For meaningful results <path> should be on a loopback NFS mount, e.g.
+   /srv/nfstest exported and mounted with "mount localhost:/srv/nfstest
+   /mnt/nfstest". The test server process can use the export directly with
+   -server-path /srv/nfstest/file, which is closest to having the server
+   on another machine. Otherwise the tests run against a local filesystem
+   stand-in, where all the caches are coherent. That is still enough to run
+   the tests and benchmarks e.g. in CI.
+
+   After checking whether a cache flush method works, the client also times
+   it: -iterations <n> (default 100, 0 disables) runs of the method's
+   before+after flush calls, measured with CLOCK_MONOTONIC. Each test ends
+   with a table of the methods that worked, cheapest (by median) first,
+   followed by the ones that didn't. Options go before the other
+   parameters, e.g. ./nfstest -iterations 1000 <host> <port> <path>
+
+   When the test file is on an NFS mount, the client also reads the mount's
+   per-operation RPC counters from /proc/self/mountstats (Linux) before and
+   after each test and each method's timing runs. The flush tables show the
+   average number of RPCs a single flush costs and which operations they
+   were, and each test is followed by the RPCs it sent in total (including
+   the timing runs). Only this machine's RPCs are seen, but the counters are
+   per mount, so other processes using the same mount are included too.
+
+   -tsv <file> or -json <file> additionally writes the client's results
+   in a machine-readable form. With "-" the records go to stdout and the
+   human-readable output to stderr, so stdout can be parsed. There's one
+   record per test and flush method (or just per test for the tests
+   without methods) with the result (FAIL if the test itself hit an
+   error), the timings and the RPC counts. The first record describes the
+   run: the kernel, the NFS mount and its options. JSON output has one
+   object per line. TSV output has a header line, and the run is described
+   by "#" comment lines before it. The TSV details column has the RPCs per
+   operation, or the benchmarks' results, as name=value pairs.
+
+   Benchmarks are run only when their letters are given in <commands>:
+
+   A: Concurrent writers. Agents increment a counter in the test file, each
+   increment done under an fcntl lock on <path>.lock after flushing the
+   attribute cache with fchown(-1, -1). Every 100th increment replaces the
+   file via rename() the way index files are recreated, so the agents with
+   the old file open get ESTALE. The test is run in rounds of 1, 2, 4, ..
+   -agents <n> (default 4) concurrent agents for -agent-secs <n> (default
+   2) each, and reports operations/s, lock wait, flush and operation
+   latency percentiles, ESTALE errors per 1000 operations, increments
+   that were lost because an agent read stale data and the operations
+   that failed with other errors. The agents count their I/O errors
+   instead of aborting the run. The other nfstest is always the first
+   agent, then the additional nfstest servers given with -agent
+   <host>:<port> (e.g. running on other NFS clients), and the rest are
+   threads in this process. The threads use OFD locks so that they block
+   each other like separate processes would.
+
+   M, B, I: Mail I/O throughput, run on the client alone for -bench-secs
+   <n> (default 5) each. M delivers mails the maildir way: create a file
+   in tmp/, write, fsync, close and rename it into cur/. B appends mails
+   to a large mdbox-style file under an fcntl lock, with fdatasync before
+   unlocking. I does small random pwrite+fdatasync updates to an
+   index-sized file. The mails are -bench-size <bytes> (default 8192).
+   The files are created next to <path> and removed afterwards. Reports
+   operations/s, latency percentiles and RPCs per operation.
+
+   L: Lock contention. -agents <n> (default 4) lockers lock and unlock
+   <path>.lock for -agent-secs <n> (default 2) with each lock method:
+   fcntl, flock and dotlock (O_EXCL creation of <path>.dotlock, polled
+   with a random 0.5..1.5ms delay). The lockers are chosen the same way
+   as with A. Reports lock acquisitions/s, the wait time distribution and
+   how fairly the lock was shared: Jain's fairness index and the fewest
+   and most acquisitions a single locker got, and the failed lock
+   operations. Note that Linux NFS clients implement flock() with fcntl
+   locks on the server.
+
+   T: Change detection with stat(). For -bench-secs the test server
+   overwrites the start of the test file every 0-2ms, keeping its size
+   the same like in-place index updates, and notifies the client after
+   each write. The client polls with open+close+stat() and checks whether
+   mtime and ctime changed at seconds, microseconds and nanoseconds
+   resolution. Reports for each how many writes were never seen (the
+   last ones of the run, stat()ed again for 2 seconds after it) and the
+   distribution of the time from a write's notification until stat()
+   showed a change (in the -tsv/-json records also as the histogram's
+   "le_<usecs>_usecs" bucket counts). The largest delay of a stamp that
+   missed nothing is the safe re-scan interval; with the others a file
+   changed within the same stamp as the last check must be assumed to
+   have changed again.
+
+   V: Write visibility without flushing. For -bench-secs the test server
+   writes an increasing sequence number to the test file in a tight loop,
+   each write with open+pwrite+close, and notifies the client after each
+   one. The client reads the file as fast as it can, first with
+   open+read+close (close-to-open consistency) and then in another round
+   with read() from a file kept open, which depends on the attribute
+   cache timeouts (acregmin/acregmax/actimeo mount options). Reports the
+   stale read rate (reads older than the last finished write), the
+   distribution of the delay from a write's notification until it was
+   first read (with the histogram buckets in the -tsv/-json records, as
+   with T), and how many writes were still unseen 10 seconds after the
+   run. Compare the results of different mount options to see what they
+   cost in freshness.
+
+   R: Directory scans, like maildir syncs of a large new/ or cur/. The
+   test server creates -dir-files <n> (default 10000) files in
+   <path>.dir, then the client scans it with readdir() alone, readdir()
+   followed by stat() of each file, and (Linux) statx() asking only for
+   type+inode or size+mtime. The stat()s are done by one thread and by
+   -scan-threads <n> (default 4) threads. Each variant is run 3 times
+   without flushing and with each method that can flush a directory's
+   caches, and reports entries/s, time per scan and RPCs per scan.
 */
 
 #if !defined(__sun) && !defined(_AIX)
@@ -24,12 +137,15 @@
 
 #if defined(__linux__) || defined(__sun)
 #  define ST_NSECS(st) (st).st_mtim.tv_nsec
+#  define ST_CTIME_NSECS(st) (st).st_ctim.tv_nsec
 #  define HAVE_ST_NSECS
 #elif defined (__FreeBSD__) || defined(__APPLE__)
 #  define ST_NSECS(st) (st).st_mtimespec.tv_nsec
+#  define ST_CTIME_NSECS(st) (st).st_ctimespec.tv_nsec
 #  define HAVE_ST_NSECS
 #else
 #  define ST_NSECS(st) 0
+#  define ST_CTIME_NSECS(st) 0
 #endif
 
 #include <stdio.h>
@@ -45,15 +161,69 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/utsname.h>
 #ifdef HAVE_FLOCK
 #  include <sys/file.h>
 #endif
 
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#ifndef MOUNTSTATS_PATH
+#  define MOUNTSTATS_PATH "/proc/self/mountstats"
+#endif
+#if defined(__linux__) && defined(STATX_TYPE)
+#  define HAVE_STATX
+#endif
+/* NFSv4.2 has about 70 operations */
+#define RPC_OPS_MAX 96
+
+/* Log-linear latency histogram in microseconds: each power of two is split
+   into LATENCY_SUB_COUNT linear buckets. */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKET_COUNT ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+/* concurrent writers benchmark */
+#define AGENTS_MAX_REMOTE 32
+#define AGENT_RECORD_SIZE 21
+#define AGENT_RECREATE_INTERVAL 100
+#define AGENT_FLUSH_METHOD NFS_CACHE_FLUSH_METHOD_FCHOWN_1_1
+#ifdef F_OFD_SETLKW
+/* fcntl locks are per process, OFD locks per open file like flock */
+#  define AGENT_SETLKW F_OFD_SETLKW
+#else
+#  define AGENT_SETLKW F_SETLKW
+#endif
+
+/* lock contention benchmark */
+#define DOTLOCK_RETRY_USECS 1000
+
+/* change detection benchmark */
+#define CHANGE_FILE_SIZE 4096
+#define CHANGE_WRITE_INTERVAL_USECS 1000
+#define CHANGE_SETTLE_MSECS 2000
+#define CHANGE_FLUSH_METHOD NFS_CACHE_FLUSH_METHOD_OPEN_CLOSE
+
+/* close-to-open visibility benchmark */
+#define VISIBILITY_RECORD_SIZE 21
+#define VISIBILITY_SETTLE_MSECS 10000
+
+/* directory scan benchmark */
+#define DIR_SCAN_MAX_THREADS 64
+#define DIR_SCAN_ROUNDS 3
+
+/* mail I/O benchmarks */
+#define BENCH_MDBOX_INITIAL_SIZE (8*1024*1024)
+#define BENCH_INDEX_SIZE (1024*1024)
+#define BENCH_INDEX_RECORD_SIZE 64
+
 enum nfs_cache_flush_method {
 	NFS_CACHE_FLUSH_METHOD_NONE,
 	NFS_CACHE_FLUSH_METHOD_OPEN_CLOSE,
@@ -108,7 +278,189 @@ nfs_cache_flush_method_names[NFS_CACHE_FLUSH_METHOD_COUNT] = {
 #endif
 };
 
+/* per-operation RPC counters of the test file's NFS mount */
+struct rpc_stats {
+	unsigned int count;
+	char names[RPC_OPS_MAX][24];
+	unsigned long long ops[RPC_OPS_MAX];
+};
+
+enum result_format {
+	RESULT_FORMAT_NONE,
+	RESULT_FORMAT_TSV,
+	RESULT_FORMAT_JSON
+};
+
+struct latency {
+	unsigned long long count;
+	/* the exact maximum, the buckets give only its upper bound */
+	unsigned long long max;
+	unsigned long long buckets[LATENCY_BUCKET_COUNT];
+};
+
+struct agent_stats {
+	/* errors are the failed operations other than ESTALE */
+	unsigned long long ops, estale, recreates, errors;
+	struct latency lock_wait, flush, op;
+};
+
+struct agent {
+	pthread_t thread;
+	const char *path;
+	unsigned int id, seed, duration_msecs;
+	int fd, lock_fd;
+	struct agent_stats stats;
+};
+
+enum lock_bench_method {
+	LOCK_BENCH_METHOD_FCNTL,
+#ifdef HAVE_FLOCK
+	LOCK_BENCH_METHOD_FLOCK,
+#endif
+	LOCK_BENCH_METHOD_DOTLOCK,
+
+	LOCK_BENCH_METHOD_COUNT
+};
+static const char *
+lock_bench_method_names[LOCK_BENCH_METHOD_COUNT] = {
+	"fcntl",
+#ifdef HAVE_FLOCK
+	"flock",
+#endif
+	"dotlock"
+};
+
+struct locker {
+	pthread_t thread;
+	const char *path;
+	enum lock_bench_method method;
+	unsigned int seed, duration_msecs;
+	/* <path>.lock, -1 with dotlocks */
+	int fd;
+	unsigned long long ops, errors;
+	struct latency wait;
+};
+
+enum change_detector_type {
+	CHANGE_DETECTOR_MTIME_SECS,
+	CHANGE_DETECTOR_MTIME_USECS,
+	CHANGE_DETECTOR_MTIME_NSECS,
+	CHANGE_DETECTOR_CTIME_SECS,
+	CHANGE_DETECTOR_CTIME_USECS,
+	CHANGE_DETECTOR_CTIME_NSECS,
+
+	CHANGE_DETECTOR_COUNT
+};
+static const char *change_detector_names[CHANGE_DETECTOR_COUNT] = {
+	"mtime secs",
+	"mtime usecs",
+	"mtime nsecs",
+	"ctime secs",
+	"ctime usecs",
+	"ctime nsecs"
+};
+
+struct change_detector {
+	/* the last seen timestamp at this resolution */
+	unsigned long long stamp;
+	/* writes [0..detected) have been seen */
+	unsigned int detected;
+	/* changes seen before the write's notification arrived */
+	unsigned int early;
+	/* from the write's notification to the stat() that saw it */
+	struct latency latency;
+};
+
+enum dir_scan_mode {
+	DIR_SCAN_MODE_READDIR,
+	DIR_SCAN_MODE_STAT,
+#ifdef HAVE_STATX
+	DIR_SCAN_MODE_STATX_TYPE,
+	DIR_SCAN_MODE_STATX_MTIME,
+#endif
+
+	DIR_SCAN_MODE_COUNT
+};
+static const char *dir_scan_mode_names[DIR_SCAN_MODE_COUNT] = {
+	"readdir",
+	"readdir+stat",
+#ifdef HAVE_STATX
+	"statx(type,ino)",
+	"statx(size,mtime)"
+#endif
+};
+
+/* the methods that can flush a directory's caches */
+#define DIR_SCAN_FLUSH_METHOD_COUNT 4
+static const enum nfs_cache_flush_method
+dir_scan_flush_methods[DIR_SCAN_FLUSH_METHOD_COUNT] = {
+	NFS_CACHE_FLUSH_METHOD_NONE,
+	NFS_CACHE_FLUSH_METHOD_FCHOWN_1_1,
+	NFS_CACHE_FLUSH_METHOD_CHOWN_1_1,
+	NFS_CACHE_FLUSH_METHOD_RMDIR
+};
+
+struct dir_scan {
+	const char *dir;
+	int dir_fd;
+	enum dir_scan_mode mode;
+	unsigned int threads;
+	/* the entries found by the last readdir, except with
+	   DIR_SCAN_MODE_READDIR which only counts them */
+	char (*names)[64];
+	unsigned int count, alloc;
+};
+
+struct dir_scan_thread {
+	pthread_t thread;
+	struct dir_scan *scan;
+	unsigned int idx;
+};
+
+struct bench {
+	/* maildir: the maildir directory */
+	char dir[512];
+	/* mdbox, index: the file */
+	int fd;
+	unsigned int seq, seed;
+	char *buf;
+	size_t buf_size;
+};
+typedef void bench_op_t(struct bench *bench);
+
+struct flush_result {
+	/* 1 = flushed the cache, 0 = didn't, -1 = not tested */
+	int ok;
+	/* wall clock cost of nfs_cache_flush_before() + _after() */
+	unsigned long long min_nsecs, median_nsecs, p99_nsecs;
+	/* RPCs sent by all the timing runs */
+	struct rpc_stats rpcs;
+};
+
 static int reverse = 0;
+static unsigned int flush_iterations = 100;
+/* the flush methods are timed after they already showed their errors */
+static int errors_muted = 0;
+/* for flush_result_cmp() */
+static const struct flush_result *flush_ranked_results;
+/* mount point whose RPCs are counted, "" if not NFS */
+static char rpc_mountpoint[1024], rpc_mount_device[1024];
+static char rpc_mount_opts[1024];
+/* -tsv or -json output */
+static enum result_format result_format = RESULT_FORMAT_NONE;
+static FILE *result_file;
+
+static unsigned int agents_max = 4, agents_duration_msecs = 2000;
+static const char *agent_hosts[AGENTS_MAX_REMOTE];
+static unsigned int agent_ports[AGENTS_MAX_REMOTE], agent_hosts_count;
+/* local agent threads wait until all the agents are ready */
+static pthread_mutex_t agents_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t agents_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int agents_ready, agents_failed;
+static int agents_go;
+
+static unsigned int bench_duration_msecs = 5000, bench_mail_size = 8192;
+static unsigned int dir_scan_files = 10000, dir_scan_threads = 4;
 
 static void i_errorv(const char *fmt, va_list args)
 {
@@ -131,6 +483,8 @@ static void i_error(const char *fmt, ...)
 {
 	va_list args;
 
+	if (errors_muted)
+		return;
 	va_start(args, fmt);
 	i_errorv(fmt, args);
 	va_end(args);
@@ -346,6 +700,447 @@ static void nfs_cache_flush_after(const char *path, int *fd_p,
 	}
 }
 
+static unsigned long long clock_nsecs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		i_fatal("clock_gettime() failed: %m");
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int nsecs_cmp(const void *p1, const void *p2)
+{
+	const unsigned long long *n1 = p1, *n2 = p2;
+
+	return *n1 < *n2 ? -1 : (*n1 > *n2 ? 1 : 0);
+}
+
+static void rpc_stats_init(const char *path)
+{
+	char dir[1024], real_dir[PATH_MAX], line[2048];
+	char device[1024], mountpoint[1024], fstype[32], *p;
+	size_t len, best_len = 0;
+	int is_nfs = 0, want_opts = 0;
+	FILE *f;
+
+	rpc_mountpoint[0] = rpc_mount_device[0] = rpc_mount_opts[0] = '\0';
+	p = strrchr(path, '/');
+	if (p == NULL)
+		strcpy(dir, ".");
+	else
+		snprintf(dir, p - path + 1, "%s", path);
+	if (realpath(dir, real_dir) == NULL) {
+		i_error("realpath(%s) failed: %m", dir);
+		return;
+	}
+
+	f = fopen(MOUNTSTATS_PATH, "r");
+	if (f == NULL) {
+		printf("RPC counts unavailable: %s: %s\n", MOUNTSTATS_PATH,
+		       strerror(errno));
+		return;
+	}
+	/* find the longest mount point containing the directory */
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (want_opts && strncmp(line, "\topts:", 6) == 0) {
+			/* "\topts:\t<options>\n" */
+			snprintf(rpc_mount_opts, sizeof(rpc_mount_opts), "%s",
+				 line + 6 + strspn(line + 6, " \t"));
+			rpc_mount_opts[strcspn(rpc_mount_opts, "\n")] = '\0';
+			continue;
+		}
+		if (sscanf(line, "device %1023s mounted on %1023s with fstype %31s",
+			   device, mountpoint, fstype) != 3)
+			continue;
+		want_opts = 0;
+		len = strlen(mountpoint);
+		if (strncmp(real_dir, mountpoint, len) != 0 ||
+		    (real_dir[len] != '/' && real_dir[len] != '\0' &&
+		     strcmp(mountpoint, "/") != 0) || len < best_len)
+			continue;
+		best_len = len;
+		is_nfs = strncmp(fstype, "nfs", 3) == 0;
+		if (is_nfs) {
+			strcpy(rpc_mountpoint, mountpoint);
+			strcpy(rpc_mount_device, device);
+			rpc_mount_opts[0] = '\0';
+			want_opts = 1;
+		}
+	}
+	fclose(f);
+	if (!is_nfs) {
+		rpc_mountpoint[0] = rpc_mount_device[0] = '\0';
+		rpc_mount_opts[0] = '\0';
+		printf("RPC counts unavailable: %s isn't on an NFS mount\n",
+		       real_dir);
+	}
+}
+
+/* Read the RPC counters. Returns -1 if they aren't available. */
+static int rpc_stats_read(struct rpc_stats *stats)
+{
+	char line[1024], mountpoint[1024], name[24];
+	unsigned long long ops;
+	int in_mount = 0, in_ops = 0;
+	FILE *f;
+
+	stats->count = 0;
+	if (rpc_mountpoint[0] == '\0')
+		return -1;
+	f = fopen(MOUNTSTATS_PATH, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "device ", 7) == 0) {
+			/* the last one wins if something is mounted over */
+			in_mount = sscanf(line, "device %*s mounted on %1023s",
+					  mountpoint) == 1 &&
+				strcmp(mountpoint, rpc_mountpoint) == 0;
+			in_ops = 0;
+			if (in_mount)
+				stats->count = 0;
+		} else if (!in_mount) {
+			continue;
+		} else if (strstr(line, "per-op statistics") != NULL) {
+			in_ops = 1;
+		} else if (in_ops &&
+			   sscanf(line, " %23[A-Z0-9_]: %llu", name, &ops) == 2 &&
+			   stats->count < RPC_OPS_MAX) {
+			strcpy(stats->names[stats->count], name);
+			stats->ops[stats->count++] = ops;
+		}
+	}
+	fclose(f);
+	return stats->count == 0 ? -1 : 0;
+}
+
+/* stats = after - stats. The operations are always listed in the same
+   order. */
+static void rpc_stats_diff(struct rpc_stats *stats,
+			   const struct rpc_stats *after)
+{
+	unsigned int i;
+
+	if (stats->count != after->count) {
+		stats->count = 0;
+		return;
+	}
+	for (i = 0; i < stats->count; i++)
+		stats->ops[i] = after->ops[i] - stats->ops[i];
+}
+
+static unsigned long long rpc_stats_total(const struct rpc_stats *stats)
+{
+	unsigned long long total = 0;
+	unsigned int i;
+
+	for (i = 0; i < stats->count; i++)
+		total += stats->ops[i];
+	return total;
+}
+
+/* Print the nonzero counters divided by divisor */
+static void rpc_stats_print(const struct rpc_stats *stats,
+			    unsigned int divisor)
+{
+	unsigned int i;
+
+	for (i = 0; i < stats->count; i++) {
+		if (stats->ops[i] == 0)
+			continue;
+		if (divisor == 1)
+			printf(" %s=%llu", stats->names[i], stats->ops[i]);
+		else {
+			printf(" %s=%.2f", stats->names[i],
+			       (double)stats->ops[i] / divisor);
+		}
+	}
+}
+
+static void json_write_string(const char *str)
+{
+	fputc('"', result_file);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', result_file);
+		if ((unsigned char)*str < 0x20)
+			fprintf(result_file, "\\u%04x", *str);
+		else
+			fputc(*str, result_file);
+	}
+	fputc('"', result_file);
+}
+
+/* Describe the run before the first result */
+static void result_write_run(const char *path)
+{
+	struct utsname u;
+	char kernel[sizeof(u.sysname) + sizeof(u.release) + sizeof(u.machine)];
+
+	if (result_format == RESULT_FORMAT_NONE)
+		return;
+	if (uname(&u) < 0)
+		i_fatal("uname() failed: %m");
+	snprintf(kernel, sizeof(kernel), "%s %s %s",
+		 u.sysname, u.release, u.machine);
+
+	if (result_format == RESULT_FORMAT_TSV) {
+		fprintf(result_file, "# time\t%ld\n", (long)time(NULL));
+		fprintf(result_file, "# kernel\t%s\n", kernel);
+		fprintf(result_file, "# path\t%s\n", path);
+		fprintf(result_file, "# mount\t%s\t%s\n",
+			rpc_mount_device, rpc_mount_opts);
+		fprintf(result_file, "test\tmethod\tresult\titerations\t"
+			"min_usecs\tmedian_usecs\tp99_usecs\trpcs\tdetails\n");
+	} else {
+		fprintf(result_file, "{\"record\":\"run\",\"time\":%ld,"
+			"\"kernel\":", (long)time(NULL));
+		json_write_string(kernel);
+		fprintf(result_file, ",\"path\":");
+		json_write_string(path);
+		fprintf(result_file, ",\"mount\":");
+		json_write_string(rpc_mount_device);
+		fprintf(result_file, ",\"mount_opts\":");
+		json_write_string(rpc_mount_opts);
+		fprintf(result_file, "}\n");
+	}
+	fflush(result_file);
+}
+
+/* Write a result record. method and flush are NULL for tests that don't
+   test the flush methods. */
+static void result_write(const char *test, const char *method,
+			 const char *result, const struct flush_result *flush)
+{
+	unsigned int i, n = flush == NULL ? 0 : flush_iterations;
+	const char *sep = "";
+	int have_rpcs = flush != NULL && flush->rpcs.count > 0 && n > 0;
+
+	switch (result_format) {
+	case RESULT_FORMAT_NONE:
+		return;
+	case RESULT_FORMAT_TSV:
+		fprintf(result_file, "%s\t%s\t%s\t%u", test,
+			method == NULL ? "" : method, result, n);
+		if (n > 0) {
+			fprintf(result_file, "\t%.1f\t%.1f\t%.1f",
+				flush->min_nsecs / 1000.0,
+				flush->median_nsecs / 1000.0,
+				flush->p99_nsecs / 1000.0);
+		} else {
+			fprintf(result_file, "\t\t\t");
+		}
+		if (have_rpcs) {
+			fprintf(result_file, "\t%.2f\t",
+				(double)rpc_stats_total(&flush->rpcs) / n);
+			for (i = 0; i < flush->rpcs.count; i++) {
+				if (flush->rpcs.ops[i] == 0)
+					continue;
+				fprintf(result_file, "%s%s=%.2f", sep,
+					flush->rpcs.names[i],
+					(double)flush->rpcs.ops[i] / n);
+				sep = ",";
+			}
+		} else {
+			fprintf(result_file, "\t\t");
+		}
+		fprintf(result_file, "\n");
+		break;
+	case RESULT_FORMAT_JSON:
+		fprintf(result_file, "{\"record\":\"result\",\"test\":");
+		json_write_string(test);
+		if (method != NULL) {
+			fprintf(result_file, ",\"method\":");
+			json_write_string(method);
+		}
+		fprintf(result_file, ",\"result\":");
+		json_write_string(result);
+		if (n > 0) {
+			fprintf(result_file, ",\"iterations\":%u,"
+				"\"min_usecs\":%.1f,\"median_usecs\":%.1f,"
+				"\"p99_usecs\":%.1f", n,
+				flush->min_nsecs / 1000.0,
+				flush->median_nsecs / 1000.0,
+				flush->p99_nsecs / 1000.0);
+		}
+		if (have_rpcs) {
+			fprintf(result_file, ",\"rpcs\":%.2f,\"rpc_ops\":{",
+				(double)rpc_stats_total(&flush->rpcs) / n);
+			for (i = 0; i < flush->rpcs.count; i++) {
+				if (flush->rpcs.ops[i] == 0)
+					continue;
+				fprintf(result_file, "%s\"%s\":%.2f", sep,
+					flush->rpcs.names[i],
+					(double)flush->rpcs.ops[i] / n);
+				sep = ",";
+			}
+			fprintf(result_file, "}");
+		}
+		fprintf(result_file, "}\n");
+		break;
+	}
+	fflush(result_file);
+}
+
+/* Counters and latencies are written as integers. Rates and ratios
+   ("..._per_..."), percentages ("..._pct") and the fairness index keep two
+   decimals. */
+static int result_value_precision(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strstr(name, "_per_") != NULL || strcmp(name, "fairness") == 0 ||
+	    (len > 4 && strcmp(name + len - 4, "_pct") == 0))
+		return 2;
+	return 0;
+}
+
+/* Write a benchmark's result record */
+static void result_write_values(const char *test, const char *variant,
+				const char *const *names, const double *values,
+				unsigned int count)
+{
+	unsigned int i;
+
+	switch (result_format) {
+	case RESULT_FORMAT_NONE:
+		return;
+	case RESULT_FORMAT_TSV:
+		fprintf(result_file, "%s\t%s\tOK\t\t\t\t\t\t", test, variant);
+		for (i = 0; i < count; i++) {
+			fprintf(result_file, "%s%s=%.*f", i == 0 ? "" : ",",
+				names[i], result_value_precision(names[i]),
+				values[i]);
+		}
+		fprintf(result_file, "\n");
+		break;
+	case RESULT_FORMAT_JSON:
+		fprintf(result_file, "{\"record\":\"result\",\"test\":");
+		json_write_string(test);
+		fprintf(result_file, ",\"method\":");
+		json_write_string(variant);
+		fprintf(result_file, ",\"result\":\"OK\"");
+		for (i = 0; i < count; i++) {
+			fprintf(result_file, ",\"%s\":%.*f", names[i],
+				result_value_precision(names[i]), values[i]);
+		}
+		fprintf(result_file, "}\n");
+		break;
+	}
+	fflush(result_file);
+}
+
+static void flush_results_init(struct flush_result *results)
+{
+	unsigned int i;
+
+	memset(results, 0, sizeof(*results) * NFS_CACHE_FLUSH_METHOD_COUNT);
+	for (i = 0; i < NFS_CACHE_FLUSH_METHOD_COUNT; i++)
+		results[i].ok = -1;
+}
+
+/* Record whether the method worked and time flush_iterations runs of it */
+static void flush_result_set(const char *path, int *fd_p,
+			     enum nfs_cache_flush_method method, int ok,
+			     struct flush_result *results)
+{
+	struct flush_result *result = &results[method];
+	struct rpc_stats rpcs_after;
+	unsigned long long start, *samples;
+	unsigned int i, n = flush_iterations;
+
+	result->ok = ok;
+	if (n == 0)
+		return;
+
+	samples = malloc(sizeof(*samples) * n);
+	if (samples == NULL)
+		i_fatal("malloc() failed: %m");
+	errors_muted = 1;
+	(void)rpc_stats_read(&result->rpcs);
+	for (i = 0; i < n; i++) {
+		start = clock_nsecs();
+		nfs_cache_flush_before(path, fd_p, method);
+		nfs_cache_flush_after(path, fd_p, method);
+		samples[i] = clock_nsecs() - start;
+	}
+	if (rpc_stats_read(&rpcs_after) < 0)
+		result->rpcs.count = 0;
+	rpc_stats_diff(&result->rpcs, &rpcs_after);
+	errors_muted = 0;
+
+	qsort(samples, n, sizeof(*samples), nsecs_cmp);
+	result->min_nsecs = samples[0];
+	result->median_nsecs = samples[n/2];
+	result->p99_nsecs = samples[n*99/100 < n-1 ? n*99/100 : n-1];
+	free(samples);
+}
+
+static int flush_result_cmp(const void *p1, const void *p2)
+{
+	const struct flush_result *r1, *r2;
+
+	r1 = &flush_ranked_results[*(const unsigned int *)p1];
+	r2 = &flush_ranked_results[*(const unsigned int *)p2];
+	if (r1->ok != r2->ok)
+		return r2->ok - r1->ok;
+	return nsecs_cmp(&r1->median_nsecs, &r2->median_nsecs);
+}
+
+/* Print the tested methods, working ones cheapest first, and write their
+   result records */
+static void flush_results_print(const char *test, const char *test_name,
+				const struct flush_result *results)
+{
+	unsigned int i, rank, tested = 0, order[NFS_CACHE_FLUSH_METHOD_COUNT];
+
+	for (i = 0; i < NFS_CACHE_FLUSH_METHOD_COUNT; i++) {
+		order[i] = i;
+		if (results[i].ok < 0)
+			continue;
+		tested++;
+		result_write(test, nfs_cache_flush_method_names[i],
+			     results[i].ok ? "OK" : "failed", &results[i]);
+	}
+	if (flush_iterations == 0 || tested == 0)
+		return;
+
+	flush_ranked_results = results;
+	qsort(order, NFS_CACHE_FLUSH_METHOD_COUNT, sizeof(order[0]),
+	      flush_result_cmp);
+
+	printf("\n%s flush methods by cost (%u iterations, usecs):\n",
+	       test_name, flush_iterations);
+	printf("%4s  %-20s %-7s %10s %10s %10s",
+	       "rank", "method", "result", "min", "median", "p99");
+	if (rpc_mountpoint[0] != '\0')
+		printf(" %7s %s", "rpcs", "per operation");
+	printf("\n");
+	for (i = rank = 0; i < NFS_CACHE_FLUSH_METHOD_COUNT; i++) {
+		const struct flush_result *result = &results[order[i]];
+
+		if (result->ok < 0)
+			continue;
+		if (result->ok)
+			printf("%4u", ++rank);
+		else
+			printf("%4s", "-");
+		printf("  %-20s %-7s %10.1f %10.1f %10.1f",
+		       nfs_cache_flush_method_names[order[i]],
+		       result->ok ? "OK" : "failed",
+		       result->min_nsecs / 1000.0,
+		       result->median_nsecs / 1000.0,
+		       result->p99_nsecs / 1000.0);
+		if (result->rpcs.count > 0) {
+			printf(" %7.2f", (double)rpc_stats_total(&result->rpcs) /
+			       flush_iterations);
+			rpc_stats_print(&result->rpcs, flush_iterations);
+		}
+		printf("\n");
+	}
+}
+
 static void send_cmd(int fd, char cmd)
 {
 	if (write(fd, &cmd, 1) != 1)
@@ -430,10 +1225,12 @@ static void nfs_test_estale_client(int socket_fd, const char *path)
 	send_cmd(socket_fd, '2');
 	wait_cmd(socket_fd, '3');
 	if ((ret = read(fd, buf, sizeof(buf))) < 0) {
-		if (errno == ESTALE)
+		if (errno == ESTALE) {
 			printf("ESTALE errors happen on read()\n");
-		else if (errno == EIO) {
+			result_write("estale", NULL, "ESTALE", NULL);
+		} else if (errno == EIO) {
 			printf("EIO errors happen on read()\n");
+			result_write("estale", NULL, "EIO", NULL);
 			if (fchown(fd, 0, (gid_t)-1) == 0)
 				printf(" - fchown() succeeded..\n");
 			else if (errno == ESTALE)
@@ -444,8 +1241,10 @@ static void nfs_test_estale_client(int socket_fd, const char *path)
 			i_fatal("read(%s) failed: %m", path);
 	} else if (ret != 5) {
 		i_error("read(%s) returned %d bytes instead of 5", path, ret);
+		result_write("estale", NULL, "FAIL", NULL);
 	} else {
 		printf("ESTALE errors don't happen\n");
+		result_write("estale", NULL, "OK", NULL);
 	}
 	close(fd);
 	wait_cmd(socket_fd, '!');
@@ -486,10 +1285,14 @@ static void nfs_test_oexcl_client(int socket_fd, const char *path)
 		if (errno == EEXIST) {
 			printf("O_EXCL appears to be working, "
 			       "but this could be just faked by NFS client\n");
-		} else
+			result_write("oexcl", NULL, "OK", NULL);
+		} else {
 			i_error("open(%s) failed: %m", path);
+			result_write("oexcl", NULL, "FAIL", NULL);
+		}
 	} else {
 		printf("O_EXCL doesn't work\n");
+		result_write("oexcl", NULL, "failed", NULL);
 		(void)close(fd);
 	}
 	wait_cmd(socket_fd, '!');
@@ -526,6 +1329,7 @@ static void nfs_test_nsecs_server(int socket_fd, const char *path)
 
 static void nfs_test_nsecs_client(int socket_fd, const char *path)
 {
+	const char *resolution = NULL;
 	struct stat st;
 	int i;
 
@@ -548,21 +1352,25 @@ static void nfs_test_nsecs_client(int socket_fd, const char *path)
 			if (stat(path, &st) < 0)
 				i_fatal("stat(%s) failed: %m", path);
 		}
-		if (ST_NSECS(st) % 1000 == 0)
-			printf("timestamps resolution: microseconds\n");
-		else
-			printf("timestamps resolution: nanoseconds\n");
+		resolution = ST_NSECS(st) % 1000 == 0 ?
+			"microseconds" : "nanoseconds";
+		printf("timestamps resolution: %s\n", resolution);
 	} else if (ST_NSECS(st) != 0) {
 		printf("timestamps resolution: other (%u)\n",
 		       (unsigned int)ST_NSECS(st));
+		resolution = "other";
 	} else {
 #ifdef HAVE_ST_NSECS
 		printf("timestamps resolution: seconds\n");
+		resolution = "seconds";
 #else
 		printf("timestamps resolution: unknown, "
 		       "don't know how to get nanoseconds from stat()\n");
+		resolution = "unknown";
 #endif
 	}
+	if (resolution != NULL)
+		result_write("nsecs", NULL, resolution, NULL);
 	send_cmd(socket_fd, '2');
 	wait_cmd(socket_fd, '!');
 }
@@ -611,11 +1419,13 @@ static void nfs_test_fattrcache_server(int socket_fd, const char *path)
 
 static void nfs_test_fattrcache_client(int socket_fd, const char *path)
 {
+	struct flush_result results[NFS_CACHE_FLUSH_METHOD_COUNT];
 	struct stat st1, st2;
 	enum nfs_cache_flush_method method;
 	int fd, fails = 0;
 
 	printf("\nTesting file attribute cache..\n");
+	flush_results_init(results);
 
 	send_cmd(socket_fd, 'F');
 	wait_cmd(socket_fd, '1');
@@ -641,6 +1451,8 @@ static void nfs_test_fattrcache_client(int socket_fd, const char *path)
 			printf("Attr cache flush %s: %s\n",
 			       nfs_cache_flush_method_names[method],
 			       st1.st_mtime == st2.st_mtime ? "failed" : "OK");
+			flush_result_set(path, &fd, method,
+					 st1.st_mtime != st2.st_mtime, results);
 			method++;
 			fails = 0;
 		} else {
@@ -654,6 +1466,7 @@ static void nfs_test_fattrcache_client(int socket_fd, const char *path)
 	}
 	close(fd);
 	send_cmd(socket_fd, '4');
+	flush_results_print("attr_cache", "Attr cache", results);
 	wait_cmd(socket_fd, '!');
 }
 
@@ -733,6 +1546,7 @@ static void nfs_test_fhandlecache_server(int socket_fd, const char *path)
 
 static void nfs_test_fhandlecache_client(int socket_fd, const char *path)
 {
+	struct flush_result results[NFS_CACHE_FLUSH_METHOD_COUNT];
 	struct stat st1, st2;
 	enum nfs_cache_flush_method method;
 	char dir[1024], temp_path1[1024], temp_path2[1024], *p;
@@ -742,6 +1556,7 @@ static void nfs_test_fhandlecache_client(int socket_fd, const char *path)
 	int fd, file_fd, success = 0;
 
 	printf("\nTesting file handle cache..\n");
+	flush_results_init(results);
 
 	snprintf(temp_path1, sizeof(temp_path1), "%s.1", path);
 	snprintf(temp_path2, sizeof(temp_path2), "%s.2", path);
@@ -810,6 +1625,8 @@ static void nfs_test_fhandlecache_client(int socket_fd, const char *path)
 			printf(" - inode changed, but mtime is wrong\n");
 		if (st1.st_ino != ino1 && st1.st_ino != ino2)
 			printf(" - inode is neither temp1 nor temp2 file's\n");
+		flush_result_set(flush_path, &fd, method,
+				 st1.st_ino != st2.st_ino, results);
 		expected_mtime++;
 		method++;
 	}
@@ -817,6 +1634,7 @@ static void nfs_test_fhandlecache_client(int socket_fd, const char *path)
 
 	if (!success)
 		printf("Looks like there's no way to flush directory's attribute cache\n");
+	flush_results_print("fhandle_cache", "File handle cache", results);
 	close(fd);
 	wait_cmd(socket_fd, '!');
 }
@@ -855,6 +1673,7 @@ static void nfs_test_neg_fhandlecache_server(int socket_fd, const char *path)
 
 static void nfs_test_neg_fhandlecache_client(int socket_fd, const char *path)
 {
+	struct flush_result results[NFS_CACHE_FLUSH_METHOD_COUNT];
 	struct stat st;
 	enum nfs_cache_flush_method method;
 	const char *flush_path;
@@ -863,6 +1682,7 @@ static void nfs_test_neg_fhandlecache_client(int socket_fd, const char *path)
 	int fd, success = 0;
 
 	printf("\nTesting negative file handle cache..\n");
+	flush_results_init(results);
 
 	p = strrchr(path, '/');
 	if (p == NULL)
@@ -907,6 +1727,7 @@ static void nfs_test_neg_fhandlecache_client(int socket_fd, const char *path)
 		       !success ? "failed" : "OK");
 		if (success && st.st_mtime != expected_mtime)
 			printf(" - mtime is wrong though\n");
+		flush_result_set(flush_path, &fd, method, success, results);
 		expected_mtime++;
 		method++;
 
@@ -917,6 +1738,8 @@ static void nfs_test_neg_fhandlecache_client(int socket_fd, const char *path)
 		wait_cmd(socket_fd, '5');
 	}
 	send_cmd(socket_fd, '6');
+	flush_results_print("neg_fhandle_cache", "Negative file handle cache",
+			    results);
 
 	close(fd);
 	wait_cmd(socket_fd, '!');
@@ -972,6 +1795,7 @@ static void nfs_test_data_cache_server(int socket_fd, const char *path)
 
 static void nfs_test_data_cache_client(int socket_fd, const char *path)
 {
+	struct flush_result results[NFS_CACHE_FLUSH_METHOD_COUNT];
 	struct stat st;
 	char buf[1024], chr;
 	time_t mtime;
@@ -979,6 +1803,7 @@ static void nfs_test_data_cache_client(int socket_fd, const char *path)
 	int fd, ret, i, method;
 
 	printf("\nTesting data cache..\n");
+	flush_results_init(results);
 
 	send_cmd(socket_fd, 'D');
 	wait_cmd(socket_fd, '1');
@@ -1061,12 +1886,14 @@ static void nfs_test_data_cache_client(int socket_fd, const char *path)
 			mtime = st.st_mtime;
 			mtime_nsecs = ST_NSECS(st);
 		}
+		flush_result_set(path, &fd, method, buf[512] == chr, results);
 
 		if (++method == NFS_CACHE_FLUSH_METHOD_COUNT)
 			break;
 		send_cmd(socket_fd, ++chr);
 	}
 	send_cmd(socket_fd, '5');
+	flush_results_print("data_cache", "Data cache", results);
 
 	close(fd);
 	wait_cmd(socket_fd, '!');
@@ -1099,11 +1926,13 @@ static void nfs_test_write_flush_server(int socket_fd, const char *path)
 
 static void nfs_test_write_flush_client(int socket_fd, const char *path)
 {
+	struct flush_result results[NFS_CACHE_FLUSH_METHOD_COUNT];
 	int fd, method = 0;
 	char cmd;
 
 	send_cmd(socket_fd, 'W');
 	printf("\nTesting write flushing..\n");
+	flush_results_init(results);
 
 	fd = nfs_safe_create(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if (fd < 0)
@@ -1123,8 +1952,10 @@ static void nfs_test_write_flush_client(int socket_fd, const char *path)
 		printf("Write flush %s: %s\n",
 		       nfs_cache_flush_method_names[method],
 		       cmd == 'O' ? "OK" : "failed");
+		flush_result_set(path, &fd, method, cmd == 'O', results);
 	}
 	send_cmd(socket_fd, '3');
+	flush_results_print("write_flush", "Write", results);
 
 	close(fd);
 	wait_cmd(socket_fd, '!');
@@ -1203,92 +2034,2049 @@ static void nfs_test_write_partial_client(int socket_fd, const char *path)
 		if (memcmp(data + i + sizeof(b)/2, b, sizeof(b)/2) != 0)
 			break;
 	}
-	if (i == sizeof(data)/sizeof(b))
+	if (i == sizeof(data)/sizeof(b)) {
 		printf("OK\n");
-	else
+		result_write("write_partial", NULL, "OK", NULL);
+	} else {
 		printf("Failed at [%d]\n", i);
+		result_write("write_partial", NULL, "failed", NULL);
+	}
 	close(fd);
 
 	wait_cmd(socket_fd, '!');
 }
 
-struct command {
-	char cmd;
-	void (*server)(int fd, const char *path);
-	void (*client)(int fd, const char *path);
-};
-
-#define ENTRY(cmd, func) \
-	{ cmd, nfs_test_ ## func ## _server, nfs_test_ ## func ## _client }
-#define N_COMMANDS (sizeof(commands)/sizeof(commands[0]))
-static struct command commands[] = {
-	ENTRY('S', estale),
-	ENTRY('E', oexcl),
-	ENTRY('N', nsecs),
-	ENTRY('F', fattrcache),
-	ENTRY('D', data_cache),
-	ENTRY('W', write_flush),
-	ENTRY('P', write_partial),
-	ENTRY('H', fhandlecache),
-	/* keep negative dir attr cache last so it won't break other tests */
-	ENTRY('G', neg_fhandlecache)
-};
+static unsigned long long clock_usecs(void)
+{
+	return clock_nsecs() / 1000;
+}
 
-static struct command *command_find(char cmd)
+static unsigned int latency_bucket_idx(unsigned long long value)
 {
-	unsigned int i;
+	unsigned int shift;
 
-	for (i = 0; i < N_COMMANDS; i++) {
-		if (commands[i].cmd == cmd)
-			return &commands[i];
-	}
-	return NULL;
+	if (value < LATENCY_SUB_COUNT)
+		return value;
+	shift = (63 - __builtin_clzll(value)) - LATENCY_SUB_BITS;
+	return ((shift + 1) << LATENCY_SUB_BITS) +
+		((value >> shift) - LATENCY_SUB_COUNT);
 }
 
-static void nfs_test_server(int fd, const char *path)
+static unsigned long long latency_bucket_max(unsigned int idx)
 {
-	struct command *cmd;
+	unsigned int shift;
 
-	if (unlink(path) < 0 && errno != ENOENT)
-		i_fatal("unlink(%s) failed: %m", path);
+	if (idx < LATENCY_SUB_COUNT)
+		return idx;
+	shift = (idx >> LATENCY_SUB_BITS) - 1;
+	return (((unsigned long long)(idx % LATENCY_SUB_COUNT) +
+		 LATENCY_SUB_COUNT) << shift) + ((1ULL << shift) - 1);
+}
 
-	send_cmd(fd, 'S');
-	wait_cmd(fd, 'C');
-	printf("Connected: Acting as test server\n");
+static void latency_add(struct latency *lat, unsigned long long usecs)
+{
+	lat->count++;
+	if (lat->max < usecs)
+		lat->max = usecs;
+	lat->buckets[latency_bucket_idx(usecs)]++;
+}
 
-	for (;;) {
-		cmd = command_find(read_cmd(fd));
-		if (cmd == NULL)
-			break;
+static void latency_merge(struct latency *dest, const struct latency *src)
+{
+	unsigned int i;
 
-		cmd->server(fd, path);
-		send_cmd(fd, '!');
-	}
+	dest->count += src->count;
+	if (dest->max < src->max)
+		dest->max = src->max;
+	for (i = 0; i < LATENCY_BUCKET_COUNT; i++)
+		dest->buckets[i] += src->buckets[i];
 }
 
-static void nfs_test_client(int fd, const char *path, const char *cmdstr)
+/* Returns the percentile's bucket's upper bound, accurate to ~6%. It's
+   capped to the exact maximum, so no percentile is reported above it. */
+static unsigned long long
+latency_percentile(const struct latency *lat, double percentile)
 {
+	unsigned long long rank, total = 0, value;
 	unsigned int i;
 
-	if (unlink(path) < 0 && errno != ENOENT)
-		i_fatal("unlink(%s) failed: %m", path);
+	if (lat->count == 0)
+		return 0;
+	rank = (unsigned long long)(percentile / 100.0 * lat->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < LATENCY_BUCKET_COUNT - 1; i++) {
+		total += lat->buckets[i];
+		if (total >= rank)
+			break;
+	}
+	value = latency_bucket_max(i);
+	return value < lat->max ? value : lat->max;
+}
 
-	send_cmd(fd, 'C');
-	wait_cmd(fd, 'S');
-	printf("Connected: Acting as test client\n");
+static void write_full(int fd, const void *data, size_t size)
+{
+	ssize_t ret;
 
-	for (i = 0; i < N_COMMANDS; i++) {
-		if (cmdstr == NULL || strchr(cmdstr, commands[i].cmd) != NULL)
-			commands[i].client(fd, path);
+	while (size > 0) {
+		ret = write(fd, data, size);
+		if (ret <= 0)
+			i_fatal("write() failed: %m");
+		data = (const char *)data + ret;
+		size -= ret;
 	}
+}
 
-	send_cmd(fd, 'X');
+/* Read a line sent by the peer. The returned string must be freed. */
+static char *read_line(int fd)
+{
+	size_t len = 0, alloc = 128;
+	char *line, cmd;
+
+	line = malloc(alloc);
+	while (line != NULL && (cmd = read_cmd(fd)) != '\n') {
+		if (len + 1 == alloc)
+			line = realloc(line, alloc *= 2);
+		if (line != NULL)
+			line[len++] = cmd;
+	}
+	if (line == NULL)
+		i_fatal("malloc() failed: %m");
+	line[len] = '\0';
+	return line;
 }
 
-static void nfs_listen(unsigned int port, const char *path, const char *cmdstr)
+static int nfs_connect_fd(const char *host, unsigned int port)
 {
 	struct sockaddr_in so;
-	socklen_t addrlen = sizeof(so);
+	struct hostent *hp;
+	int fd;
+
+	hp = gethostbyname(host);
+	if (hp == NULL || hp->h_addr_list[0] == NULL)
+		i_fatal("gethostbyname(%s) failed", host);
+
+	memset(&so, 0, sizeof(so));
+        so.sin_family = AF_INET;
+	so.sin_port = htons(port);
+	memcpy(&so.sin_addr.s_addr, hp->h_addr_list[0], 4);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		i_fatal("socket() failed: %m");
+	if (connect(fd, (void *)&so, sizeof(so)) < 0)
+		i_fatal("connect(%s:%u) failed: %m", host, port);
+	return fd;
+}
+
+/* Count a failed operation of an agent or a locker thread. Only the first
+   one is logged, so a broken mount doesn't flood the output. */
+static void bench_errorv(unsigned long long *errors, const char *fmt,
+			 va_list args)
+{
+	if ((*errors)++ == 0)
+		i_errorv(fmt, args);
+}
+
+/* The agents' I/O errors are results, not reasons to abort the run.
+   ESTALE is expected after another agent has replaced the file. */
+static void agent_error(struct agent *agent, const char *fmt, ...)
+{
+	va_list args;
+
+	if (errno == ESTALE) {
+		agent->stats.estale++;
+		return;
+	}
+	va_start(args, fmt);
+	bench_errorv(&agent->stats.errors, fmt, args);
+	va_end(args);
+}
+
+static int agent_lock(struct agent *agent, int lock_type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = lock_type;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(agent->lock_fd, AGENT_SETLKW, &fl) < 0) {
+		agent_error(agent, "fcntl(%s.lock, setlkw) failed: %m",
+			    agent->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int agent_open(struct agent *agent)
+{
+	char lock_path[1024];
+
+	agent->fd = nfs_safe_open(agent->path, O_RDWR);
+	if (agent->fd == -1) {
+		i_error("open(%s) failed: %m", agent->path);
+		return -1;
+	}
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", agent->path);
+	/* a separate lock file, since the data file gets replaced */
+	agent->lock_fd = nfs_safe_open(lock_path, O_RDWR);
+	if (agent->lock_fd == -1) {
+		i_error("open(%s) failed: %m", lock_path);
+		close(agent->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int agent_reopen(struct agent *agent)
+{
+	if (agent->fd != -1)
+		close(agent->fd);
+	agent->fd = nfs_safe_open(agent->path, O_RDWR);
+	if (agent->fd == -1) {
+		agent_error(agent, "open(%s) failed: %m", agent->path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read the counter, reopening the file if it was replaced */
+static int agent_read_counter(struct agent *agent,
+			      unsigned long long *counter_r)
+{
+	char buf[AGENT_RECORD_SIZE + 1];
+	struct stat st1, st2;
+	ssize_t ret;
+	int i;
+
+	/* a previous reopen failed */
+	if (agent->fd == -1 && agent_reopen(agent) < 0)
+		return -1;
+
+	/* the way Dovecot notices that a file was recreated */
+	if (fstat(agent->fd, &st1) < 0) {
+		if (errno != ESTALE) {
+			agent_error(agent, "fstat(%s) failed: %m",
+				    agent->path);
+			return -1;
+		}
+		agent->stats.estale++;
+		if (agent_reopen(agent) < 0)
+			return -1;
+	} else if (stat(agent->path, &st2) < 0) {
+		agent_error(agent, "stat(%s) failed: %m", agent->path);
+		return -1;
+	} else if (st1.st_ino != st2.st_ino) {
+		if (agent_reopen(agent) < 0)
+			return -1;
+	}
+
+	for (i = 0;; i++) {
+		ret = pread(agent->fd, buf, AGENT_RECORD_SIZE, 0);
+		if (ret >= 0 || errno != ESTALE || i == 10)
+			break;
+		agent->stats.estale++;
+		if (agent_reopen(agent) < 0)
+			return -1;
+	}
+	if (ret < 0) {
+		agent_error(agent, "pread(%s) failed: %m", agent->path);
+		return -1;
+	}
+	buf[ret] = '\0';
+	*counter_r = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+static int agent_write_counter(struct agent *agent, unsigned long long counter)
+{
+	char buf[AGENT_RECORD_SIZE + 1], temp_path[1024];
+	int fd;
+
+	snprintf(buf, sizeof(buf), "%0*llu\n", AGENT_RECORD_SIZE - 1, counter);
+	if (rand_r(&agent->seed) % AGENT_RECREATE_INTERVAL != 0) {
+		if (pwrite(agent->fd, buf, AGENT_RECORD_SIZE, 0) !=
+		    AGENT_RECORD_SIZE) {
+			agent_error(agent, "pwrite(%s) failed: %m",
+				    agent->path);
+			return -1;
+		}
+		if (fsync(agent->fd) < 0) {
+			agent_error(agent, "fsync(%s) failed: %m",
+				    agent->path);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* replace the file the way index files are recreated. the other
+	   agents will see ESTALE with their old fds. */
+	snprintf(temp_path, sizeof(temp_path), "%s.%ld.%u", agent->path,
+		 (long)getpid(), agent->id);
+	fd = nfs_safe_create(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		agent_error(agent, "creat(%s) failed: %m", temp_path);
+		return -1;
+	}
+	if (write(fd, buf, AGENT_RECORD_SIZE) != AGENT_RECORD_SIZE)
+		agent_error(agent, "write(%s) failed: %m", temp_path);
+	else if (fsync(fd) < 0)
+		agent_error(agent, "fsync(%s) failed: %m", temp_path);
+	else if (rename(temp_path, agent->path) < 0) {
+		agent_error(agent, "rename(%s, %s) failed: %m",
+			    temp_path, agent->path);
+	} else {
+		close(agent->fd);
+		agent->fd = fd;
+		agent->stats.recreates++;
+		return 0;
+	}
+	close(fd);
+	(void)unlink(temp_path);
+	return -1;
+}
+
+/* Flush the attribute cache the AGENT_FLUSH_METHOD way. Done here instead
+   of with nfs_cache_flush_before(), which would abort on errors. */
+static int agent_flush(struct agent *agent)
+{
+	if (agent->fd == -1 ||
+	    fchown(agent->fd, (uid_t)-1, (gid_t)-1) == 0)
+		return 0;
+	if (errno == ESTALE) {
+		/* another agent replaced the file. reopening it now keeps
+		   agent_read_counter() from counting the ESTALE again. */
+		agent->stats.estale++;
+		return agent_reopen(agent);
+	}
+	agent_error(agent, "fchown(%s, -1, -1) failed: %m", agent->path);
+	return -1;
+}
+
+/* Increment the shared counter under lock until the duration is over */
+static void agent_run(struct agent *agent)
+{
+	unsigned long long start, now, end, counter;
+	int ret;
+
+	start = clock_usecs();
+	end = start + agent->duration_msecs * 1000ULL;
+	for (now = start; now < end; start = now) {
+		if (agent_lock(agent, F_WRLCK) < 0) {
+			now = clock_usecs();
+			continue;
+		}
+		now = clock_usecs();
+		latency_add(&agent->stats.lock_wait, now - start);
+
+		ret = agent_flush(agent);
+		latency_add(&agent->stats.flush, clock_usecs() - now);
+
+		/* only the completed increments count as operations, so
+		   the failed ones aren't reported as lost */
+		if (ret < 0 || agent_read_counter(agent, &counter) < 0 ||
+		    agent_write_counter(agent, counter + 1) < 0)
+			ret = -1;
+		else
+			ret = 0;
+		(void)agent_lock(agent, F_UNLCK);
+
+		now = clock_usecs();
+		if (ret == 0) {
+			latency_add(&agent->stats.op, now - start);
+			agent->stats.ops++;
+		}
+	}
+	if (agent->fd != -1)
+		close(agent->fd);
+	close(agent->lock_fd);
+}
+
+static void agent_stats_merge(struct agent_stats *dest,
+			      const struct agent_stats *src)
+{
+	dest->ops += src->ops;
+	dest->estale += src->estale;
+	dest->recreates += src->recreates;
+	dest->errors += src->errors;
+	latency_merge(&dest->lock_wait, &src->lock_wait);
+	latency_merge(&dest->flush, &src->flush);
+	latency_merge(&dest->op, &src->op);
+}
+
+static void latency_send(int fd, const struct latency *lat)
+{
+	char buf[64];
+	unsigned int i;
+
+	snprintf(buf, sizeof(buf), " %llu %llu", lat->count, lat->max);
+	write_full(fd, buf, strlen(buf));
+	for (i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+		if (lat->buckets[i] == 0)
+			continue;
+		snprintf(buf, sizeof(buf), " %u:%llu", i, lat->buckets[i]);
+		write_full(fd, buf, strlen(buf));
+	}
+	write_full(fd, " ;", 2);
+}
+
+/* "<ops> <estale> <recreates> <errors>" followed by the latencies as
+   " <count> <max> <bucket>:<count>... ;" */
+static void agent_stats_send(int fd, const struct agent_stats *stats)
+{
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), "%llu %llu %llu %llu", stats->ops,
+		 stats->estale, stats->recreates, stats->errors);
+	write_full(fd, buf, strlen(buf));
+	latency_send(fd, &stats->lock_wait);
+	latency_send(fd, &stats->flush);
+	latency_send(fd, &stats->op);
+	write_full(fd, "\n", 1);
+}
+
+static const char *latency_parse(const char *p, struct latency *lat)
+{
+	unsigned long long count;
+	unsigned int idx;
+	int len;
+
+	if (sscanf(p, " %llu %llu%n", &lat->count, &lat->max, &len) != 2)
+		return NULL;
+	for (p += len; sscanf(p, " %u:%llu%n", &idx, &count, &len) == 2;
+	     p += len) {
+		if (idx >= LATENCY_BUCKET_COUNT)
+			return NULL;
+		lat->buckets[idx] = count;
+	}
+	while (*p == ' ')
+		p++;
+	return *p == ';' ? p + 1 : NULL;
+}
+
+/* Write a result record with the histogram's non-empty buckets appended
+   as "le_<bucket max>_usecs" = count, the same buckets latency_send()
+   sends. */
+#define LATENCY_NAME_SIZE 32
+static void result_write_latency(const char *test, const char *variant,
+				 const char *const *names, const double *values,
+				 unsigned int count, const struct latency *lat)
+{
+	const char **all_names;
+	char *bucket_names;
+	double *all_values;
+	unsigned int i, n = count;
+
+	all_names = malloc(sizeof(*all_names) *
+			   (count + LATENCY_BUCKET_COUNT));
+	all_values = malloc(sizeof(*all_values) *
+			    (count + LATENCY_BUCKET_COUNT));
+	bucket_names = malloc(LATENCY_BUCKET_COUNT * LATENCY_NAME_SIZE);
+	if (all_names == NULL || all_values == NULL || bucket_names == NULL)
+		i_fatal("malloc() failed: %m");
+	memcpy(all_names, names, sizeof(*names) * count);
+	memcpy(all_values, values, sizeof(*values) * count);
+	for (i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+		if (lat->buckets[i] == 0)
+			continue;
+		all_names[n] = bucket_names + i * LATENCY_NAME_SIZE;
+		snprintf(bucket_names + i * LATENCY_NAME_SIZE,
+			 LATENCY_NAME_SIZE, "le_%llu_usecs",
+			 latency_bucket_max(i));
+		all_values[n++] = lat->buckets[i];
+	}
+	result_write_values(test, variant, all_names, all_values, n);
+	free(all_names);
+	free(all_values);
+	free(bucket_names);
+}
+
+static void agent_stats_read(int fd, struct agent_stats *stats)
+{
+	char *line;
+	const char *p;
+	int len;
+
+	memset(stats, 0, sizeof(*stats));
+	line = read_line(fd);
+	if (sscanf(line, "%llu %llu %llu %llu%n", &stats->ops, &stats->estale,
+		   &stats->recreates, &stats->errors, &len) != 4 ||
+	    (p = latency_parse(line + len, &stats->lock_wait)) == NULL ||
+	    (p = latency_parse(p, &stats->flush)) == NULL ||
+	    (p = latency_parse(p, &stats->op)) == NULL)
+		i_fatal("Invalid agent stats: %s", line);
+	free(line);
+}
+
+/* Connect to the -agent hosts. remote_fds[0] is the -remote connection.
+   Returns the number of remote agents. */
+static unsigned int agents_connect(int socket_fd, int *remote_fds)
+{
+	unsigned int i, remote_count = 1;
+
+	remote_fds[0] = socket_fd;
+	for (i = 0; i < agent_hosts_count; i++) {
+		remote_fds[remote_count] =
+			nfs_connect_fd(agent_hosts[i], agent_ports[i]);
+		send_cmd(remote_fds[remote_count], 'C');
+		wait_cmd(remote_fds[remote_count], 'S');
+		remote_count++;
+	}
+#ifndef F_OFD_SETLKW
+	if (agents_max > remote_count) {
+		printf("Warning: No OFD locks, so the local threads' "
+		       "fcntl locks don't block each other\n");
+	}
+#endif
+	return remote_count;
+}
+
+static void agents_disconnect(const int *remote_fds, unsigned int remote_count)
+{
+	unsigned int i;
+
+	for (i = 1; i < remote_count; i++) {
+		send_cmd(remote_fds[i], 'X');
+		close(remote_fds[i]);
+	}
+}
+
+/* Call before creating a round's local threads */
+static void agents_barrier_init(void)
+{
+	agents_ready = agents_failed = 0;
+	agents_go = 0;
+}
+
+/* Called by a local thread once it has opened its files (or failed to).
+   Returns when agents_barrier_start() lets everyone go. */
+static void agents_barrier_wait(int success)
+{
+	pthread_mutex_lock(&agents_mutex);
+	if (success)
+		agents_ready++;
+	else
+		agents_failed++;
+	pthread_cond_broadcast(&agents_cond);
+	while (!agents_go)
+		pthread_cond_wait(&agents_cond, &agents_mutex);
+	pthread_mutex_unlock(&agents_mutex);
+}
+
+/* Wait for the local_n threads to be ready and start them and the
+   remote_n remote agents at the same time. Returns the number of local
+   threads that failed to get ready; they're started anyway. */
+static unsigned int
+agents_barrier_start(const int *remote_fds, unsigned int remote_n,
+		     unsigned int local_n)
+{
+	unsigned int i, failed;
+
+	pthread_mutex_lock(&agents_mutex);
+	while (agents_ready + agents_failed < local_n)
+		pthread_cond_wait(&agents_cond, &agents_mutex);
+	failed = agents_failed;
+	for (i = 0; i < remote_n; i++)
+		send_cmd(remote_fds[i], '2');
+	agents_go = 1;
+	pthread_cond_broadcast(&agents_cond);
+	pthread_mutex_unlock(&agents_mutex);
+	return failed;
+}
+
+static void *agent_thread(void *context)
+{
+	struct agent *agent = context;
+	int ret = agent_open(agent);
+
+	agents_barrier_wait(ret == 0);
+	if (ret == 0)
+		agent_run(agent);
+	return NULL;
+}
+
+/* Create the counter and lock files for a round */
+static void agents_files_reset(const char *path)
+{
+	char buf[AGENT_RECORD_SIZE + 1], lock_path[1024];
+	int fd;
+
+	snprintf(buf, sizeof(buf), "%0*u\n", AGENT_RECORD_SIZE - 1, 0);
+	fd = nfs_safe_create(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	if (write(fd, buf, AGENT_RECORD_SIZE) != AGENT_RECORD_SIZE)
+		i_fatal("write(%s) failed: %m", path);
+	if (fsync(fd) < 0)
+		i_fatal("fsync(%s) failed: %m", path);
+	close(fd);
+
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+	fd = nfs_safe_create(lock_path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", lock_path);
+	close(fd);
+}
+
+/* Run one round with count agents, the remote ones first. Returns the
+   number of lost increments. */
+static unsigned long long
+agents_round(const int *remote_fds, unsigned int remote_count,
+	     unsigned int count, const char *path, struct agent_stats *total)
+{
+	struct agent *agents, final;
+	struct agent_stats stats;
+	unsigned int i, remote_n, local_n;
+	unsigned long long counter;
+	char buf[32];
+
+	remote_n = count < remote_count ? count : remote_count;
+	local_n = count - remote_n;
+	memset(total, 0, sizeof(*total));
+	agents_files_reset(path);
+
+	snprintf(buf, sizeof(buf), "%u\n", agents_duration_msecs);
+	for (i = 0; i < remote_n; i++) {
+		send_cmd(remote_fds[i], 'A');
+		write_full(remote_fds[i], buf, strlen(buf));
+	}
+	for (i = 0; i < remote_n; i++)
+		wait_cmd(remote_fds[i], '1');
+
+	agents = calloc(local_n, sizeof(*agents));
+	if (agents == NULL && local_n > 0)
+		i_fatal("calloc() failed: %m");
+	agents_barrier_init();
+	for (i = 0; i < local_n; i++) {
+		agents[i].path = path;
+		agents[i].id = i;
+		agents[i].seed = i + 1;
+		agents[i].duration_msecs = agents_duration_msecs;
+		if (pthread_create(&agents[i].thread, NULL,
+				   agent_thread, &agents[i]) != 0)
+			i_fatal("pthread_create() failed");
+	}
+	if (agents_barrier_start(remote_fds, remote_n, local_n) > 0)
+		i_fatal("Local agents couldn't open the test files");
+
+	for (i = 0; i < local_n; i++) {
+		pthread_join(agents[i].thread, NULL);
+		agent_stats_merge(total, &agents[i].stats);
+	}
+	free(agents);
+	for (i = 0; i < remote_n; i++) {
+		agent_stats_read(remote_fds[i], &stats);
+		agent_stats_merge(total, &stats);
+		wait_cmd(remote_fds[i], '!');
+	}
+
+	/* every increment was done under the lock, so the counter should
+	   match the number of operations unless some agent read stale
+	   data */
+	memset(&final, 0, sizeof(final));
+	final.path = path;
+	if (agent_open(&final) < 0)
+		i_fatal("Can't open %s", path);
+	if (agent_lock(&final, F_RDLCK) < 0 ||
+	    agent_read_counter(&final, &counter) < 0)
+		i_fatal("Can't read the final counter from %s", path);
+	(void)agent_lock(&final, F_UNLCK);
+	close(final.fd);
+	close(final.lock_fd);
+	return counter > total->ops ? 0 : total->ops - counter;
+}
+
+static void nfs_test_agents_server(int socket_fd, const char *path)
+{
+	struct agent agent;
+	char *line;
+
+	memset(&agent, 0, sizeof(agent));
+	line = read_line(socket_fd);
+	agent.duration_msecs = strtoul(line, NULL, 10);
+	free(line);
+	agent.path = path;
+	agent.seed = getpid();
+	if (agent_open(&agent) < 0)
+		i_fatal("Can't open the test files");
+
+	send_cmd(socket_fd, '1');
+	wait_cmd(socket_fd, '2');
+	agent_run(&agent);
+	agent_stats_send(socket_fd, &agent.stats);
+}
+
+static void nfs_test_agents_client(int socket_fd, const char *path)
+{
+	int remote_fds[AGENTS_MAX_REMOTE + 1];
+	struct agent_stats stats;
+	unsigned long long lost;
+	unsigned int count, remote_count;
+	const char *names[11];
+	double values[11];
+	char variant[32];
+	double secs;
+
+	printf("\nTesting concurrent writers..\n");
+	remote_count = agents_connect(socket_fd, remote_fds);
+
+	printf("%6s %9s %15s %15s %15s %10s %9s %6s %6s\n", "agents", "ops/s",
+	       "lock wait p50/99", "flush p50/99", "op p50/99",
+	       "estale/1k", "recreates", "lost", "errors");
+	for (count = 1;; count = count * 2 < agents_max ? count * 2 : agents_max) {
+		lost = agents_round(remote_fds, remote_count, count, path, &stats);
+		secs = agents_duration_msecs / 1000.0;
+		printf("%6u %9.1f %7llu/%-7llu %7llu/%-7llu %7llu/%-7llu "
+		       "%10.2f %9llu %6llu %6llu\n", count, stats.ops / secs,
+		       latency_percentile(&stats.lock_wait, 50),
+		       latency_percentile(&stats.lock_wait, 99),
+		       latency_percentile(&stats.flush, 50),
+		       latency_percentile(&stats.flush, 99),
+		       latency_percentile(&stats.op, 50),
+		       latency_percentile(&stats.op, 99),
+		       stats.ops == 0 ? 0 : stats.estale * 1000.0 / stats.ops,
+		       stats.recreates, lost, stats.errors);
+
+		names[0] = "ops_per_sec"; values[0] = stats.ops / secs;
+		names[1] = "lock_wait_p50_usecs";
+		values[1] = latency_percentile(&stats.lock_wait, 50);
+		names[2] = "lock_wait_p99_usecs";
+		values[2] = latency_percentile(&stats.lock_wait, 99);
+		names[3] = "flush_p50_usecs";
+		values[3] = latency_percentile(&stats.flush, 50);
+		names[4] = "flush_p99_usecs";
+		values[4] = latency_percentile(&stats.flush, 99);
+		names[5] = "op_p50_usecs";
+		values[5] = latency_percentile(&stats.op, 50);
+		names[6] = "op_p99_usecs";
+		values[6] = latency_percentile(&stats.op, 99);
+		names[7] = "estale"; values[7] = stats.estale;
+		names[8] = "recreates"; values[8] = stats.recreates;
+		names[9] = "lost"; values[9] = lost;
+		names[10] = "errors"; values[10] = stats.errors;
+		snprintf(variant, sizeof(variant), "%u agents", count);
+		result_write_values("agents", variant, names, values, 11);
+
+		if (count == agents_max)
+			break;
+	}
+	printf("(usecs, flush = %s, lock wait and op include waiting for "
+	       "the other agents)\n",
+	       nfs_cache_flush_method_names[AGENT_FLUSH_METHOD]);
+
+	agents_disconnect(remote_fds, remote_count);
+}
+
+static void bench_buf_init(struct bench *bench, size_t size)
+{
+	size_t i;
+
+	bench->buf = malloc(size);
+	if (bench->buf == NULL)
+		i_fatal("malloc() failed: %m");
+	bench->buf_size = size;
+	/* something that looks a bit like a mail body */
+	for (i = 0; i < size; i++)
+		bench->buf[i] = i % 77 == 76 ? '\n' : 'a' + i % 26;
+}
+
+/* Run op for bench_duration_msecs, print and write the results */
+static void bench_run(struct bench *bench, bench_op_t *op, const char *test)
+{
+	struct rpc_stats rpcs, rpcs_after;
+	struct latency *lat;
+	unsigned long long start, end, now;
+	const char *names[8];
+	double values[8], secs, rpcs_per_op = 0;
+
+	lat = calloc(1, sizeof(*lat));
+	if (lat == NULL)
+		i_fatal("calloc() failed: %m");
+	(void)rpc_stats_read(&rpcs);
+	start = now = clock_usecs();
+	end = start + bench_duration_msecs * 1000ULL;
+	do {
+		op(bench);
+		latency_add(lat, clock_usecs() - now);
+		now = clock_usecs();
+	} while (now < end);
+	secs = (now - start) / 1000000.0;
+	if (rpc_stats_read(&rpcs_after) == 0 && rpcs.count > 0) {
+		rpc_stats_diff(&rpcs, &rpcs_after);
+		rpcs_per_op = (double)rpc_stats_total(&rpcs) / lat->count;
+	} else {
+		rpcs.count = 0;
+	}
+
+	printf("%9s %9s %7s %7s %7s %7s %7s", "ops", "ops/s",
+	       "p50", "p90", "p99", "p99.9", "max");
+	if (rpcs.count > 0)
+		printf(" %7s %s", "rpcs", "per operation");
+	printf("\n%9llu %9.1f %7llu %7llu %7llu %7llu %7llu", lat->count,
+	       lat->count / secs, latency_percentile(lat, 50),
+	       latency_percentile(lat, 90), latency_percentile(lat, 99),
+	       latency_percentile(lat, 99.9), lat->max);
+	if (rpcs.count > 0) {
+		printf(" %7.2f", rpcs_per_op);
+		rpc_stats_print(&rpcs, lat->count);
+	}
+	printf("\n(usecs per operation)\n");
+
+	names[0] = "ops"; values[0] = lat->count;
+	names[1] = "ops_per_sec"; values[1] = lat->count / secs;
+	names[2] = "p50_usecs"; values[2] = latency_percentile(lat, 50);
+	names[3] = "p90_usecs"; values[3] = latency_percentile(lat, 90);
+	names[4] = "p99_usecs"; values[4] = latency_percentile(lat, 99);
+	names[5] = "p999_usecs"; values[5] = latency_percentile(lat, 99.9);
+	names[6] = "max_usecs"; values[6] = lat->max;
+	names[7] = "rpcs_per_op"; values[7] = rpcs_per_op;
+	/* leave out the RPCs if they couldn't be counted, not 0 */
+	result_write_values(test, "", names, values, rpcs.count > 0 ? 8 : 7);
+	free(lat);
+}
+
+/* The benchmarks run on the client alone */
+static void nfs_test_bench_server(int socket_fd __attribute__((unused)),
+				  const char *path __attribute__((unused)))
+{
+}
+#define nfs_test_maildir_server nfs_test_bench_server
+#define nfs_test_mdbox_server nfs_test_bench_server
+#define nfs_test_index_server nfs_test_bench_server
+
+static void bench_maildir_op(struct bench *bench)
+{
+	char name[64], tmp_path[1024], cur_path[1024];
+	int fd;
+
+	snprintf(name, sizeof(name), "%ld.P%ldQ%u.nfstest",
+		 (long)time(NULL), (long)getpid(), bench->seq++);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/tmp/%s", bench->dir, name);
+	snprintf(cur_path, sizeof(cur_path), "%s/cur/%s:2,", bench->dir, name);
+
+	fd = nfs_safe_create(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", tmp_path);
+	write_full(fd, bench->buf, bench->buf_size);
+	if (fsync(fd) < 0)
+		i_fatal("fsync(%s) failed: %m", tmp_path);
+	if (close(fd) < 0)
+		i_fatal("close(%s) failed: %m", tmp_path);
+	if (rename(tmp_path, cur_path) < 0)
+		i_fatal("rename(%s, %s) failed: %m", tmp_path, cur_path);
+}
+
+static void bench_dir_remove(const char *dir)
+{
+	char path[1024];
+	struct dirent *d;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		if (errno != ENOENT)
+			i_error("opendir(%s) failed: %m", dir);
+		return;
+	}
+	while ((d = readdir(dirp)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		if (unlink(path) < 0)
+			i_error("unlink(%s) failed: %m", path);
+	}
+	closedir(dirp);
+	if (rmdir(dir) < 0)
+		i_error("rmdir(%s) failed: %m", dir);
+}
+
+static void bench_maildir_remove(struct bench *bench)
+{
+	char dir[1024];
+
+	snprintf(dir, sizeof(dir), "%s/tmp", bench->dir);
+	bench_dir_remove(dir);
+	snprintf(dir, sizeof(dir), "%s/cur", bench->dir);
+	bench_dir_remove(dir);
+	if (rmdir(bench->dir) < 0 && errno != ENOENT)
+		i_error("rmdir(%s) failed: %m", bench->dir);
+}
+
+static void nfs_test_maildir_client(int socket_fd, const char *path)
+{
+	struct bench bench;
+	char dir[1024];
+
+	printf("\nTesting maildir delivery throughput "
+	       "(create+write+fsync+rename, %u bytes)..\n", bench_mail_size);
+	send_cmd(socket_fd, 'M');
+	memset(&bench, 0, sizeof(bench));
+	snprintf(bench.dir, sizeof(bench.dir), "%s.maildir", path);
+	bench_maildir_remove(&bench);
+	if (mkdir(bench.dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", bench.dir);
+	snprintf(dir, sizeof(dir), "%s/tmp", bench.dir);
+	if (mkdir(dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	snprintf(dir, sizeof(dir), "%s/cur", bench.dir);
+	if (mkdir(dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	bench_buf_init(&bench, bench_mail_size);
+
+	bench_run(&bench, bench_maildir_op, "maildir");
+
+	bench_maildir_remove(&bench);
+	free(bench.buf);
+	wait_cmd(socket_fd, '!');
+}
+
+static void bench_mdbox_op(struct bench *bench)
+{
+	struct flock fl;
+	struct stat st;
+
+	/* appends are done under a write lock, at the current end of file */
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(bench->fd, F_SETLKW, &fl) < 0)
+		i_fatal("fcntl(setlkw, write) failed: %m");
+	if (fstat(bench->fd, &st) < 0)
+		i_fatal("fstat() failed: %m");
+	if (pwrite(bench->fd, bench->buf, bench->buf_size,
+		   st.st_size) != (ssize_t)bench->buf_size)
+		i_fatal("pwrite(mdbox) failed: %m");
+	if (fdatasync(bench->fd) < 0)
+		i_fatal("fdatasync(mdbox) failed: %m");
+	fl.l_type = F_UNLCK;
+	if (fcntl(bench->fd, F_SETLK, &fl) < 0)
+		i_fatal("fcntl(setlk, unlock) failed: %m");
+}
+
+/* Create path with size bytes of the benchmark's buffer contents */
+static int bench_file_create(struct bench *bench, const char *path,
+			     off_t size)
+{
+	size_t n;
+	int fd;
+
+	fd = nfs_safe_create(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	for (; size > 0; size -= n) {
+		n = (off_t)bench->buf_size < size ? bench->buf_size :
+			(size_t)size;
+		write_full(fd, bench->buf, n);
+	}
+	if (fsync(fd) < 0)
+		i_fatal("fsync(%s) failed: %m", path);
+	return fd;
+}
+
+static void nfs_test_mdbox_client(int socket_fd, const char *path)
+{
+	struct bench bench;
+	char mdbox_path[1024];
+
+	printf("\nTesting mdbox append throughput "
+	       "(lock+append+fdatasync+unlock, %u bytes, %u MB file)..\n",
+	       bench_mail_size, BENCH_MDBOX_INITIAL_SIZE / (1024*1024));
+	send_cmd(socket_fd, 'B');
+	memset(&bench, 0, sizeof(bench));
+	snprintf(mdbox_path, sizeof(mdbox_path), "%s.mdbox", path);
+	bench_buf_init(&bench, bench_mail_size);
+	bench.fd = bench_file_create(&bench, mdbox_path,
+				     BENCH_MDBOX_INITIAL_SIZE);
+
+	bench_run(&bench, bench_mdbox_op, "mdbox");
+
+	close(bench.fd);
+	if (unlink(mdbox_path) < 0)
+		i_error("unlink(%s) failed: %m", mdbox_path);
+	free(bench.buf);
+	wait_cmd(socket_fd, '!');
+}
+
+static void bench_index_op(struct bench *bench)
+{
+	off_t offset;
+
+	offset = (off_t)(rand_r(&bench->seed) %
+			 (BENCH_INDEX_SIZE / BENCH_INDEX_RECORD_SIZE)) *
+		BENCH_INDEX_RECORD_SIZE;
+	bench->buf[0]++;
+	if (pwrite(bench->fd, bench->buf, BENCH_INDEX_RECORD_SIZE,
+		   offset) != BENCH_INDEX_RECORD_SIZE)
+		i_fatal("pwrite(index) failed: %m");
+	if (fdatasync(bench->fd) < 0)
+		i_fatal("fdatasync(index) failed: %m");
+}
+
+static void nfs_test_index_client(int socket_fd, const char *path)
+{
+	struct bench bench;
+	char index_path[1024];
+
+	printf("\nTesting index update throughput "
+	       "(random %u byte pwrite+fdatasync, %u kB file)..\n",
+	       BENCH_INDEX_RECORD_SIZE, BENCH_INDEX_SIZE / 1024);
+	send_cmd(socket_fd, 'I');
+	memset(&bench, 0, sizeof(bench));
+	snprintf(index_path, sizeof(index_path), "%s.index", path);
+	bench.seed = getpid();
+	bench_buf_init(&bench, BENCH_INDEX_RECORD_SIZE);
+	bench.fd = bench_file_create(&bench, index_path, BENCH_INDEX_SIZE);
+
+	bench_run(&bench, bench_index_op, "index");
+
+	close(bench.fd);
+	if (unlink(index_path) < 0)
+		i_error("unlink(%s) failed: %m", index_path);
+	free(bench.buf);
+	wait_cmd(socket_fd, '!');
+}
+
+static void locker_open(struct locker *locker)
+{
+	char lock_path[1024];
+
+	locker->fd = -1;
+	if (locker->method == LOCK_BENCH_METHOD_DOTLOCK)
+		return;
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", locker->path);
+	locker->fd = nfs_safe_open(lock_path, O_RDWR);
+	if (locker->fd == -1)
+		i_fatal("open(%s) failed: %m", lock_path);
+}
+
+static void locker_error(struct locker *locker, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	bench_errorv(&locker->errors, fmt, args);
+	va_end(args);
+}
+
+/* Returns -1 if locking failed, or if the dotlock couldn't be created
+   before end_usecs. */
+static int locker_lock(struct locker *locker, int lock,
+		       unsigned long long end_usecs)
+{
+	char dotlock_path[1024];
+	struct flock fl;
+	int fd;
+
+	switch (locker->method) {
+	case LOCK_BENCH_METHOD_FCNTL:
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = lock ? F_WRLCK : F_UNLCK;
+		fl.l_whence = SEEK_SET;
+		if (fcntl(locker->fd, AGENT_SETLKW, &fl) < 0) {
+			locker_error(locker, "fcntl(%s.lock, setlkw) "
+				     "failed: %m", locker->path);
+			return -1;
+		}
+		break;
+#ifdef HAVE_FLOCK
+	case LOCK_BENCH_METHOD_FLOCK:
+		if (flock(locker->fd, lock ? LOCK_EX : LOCK_UN) < 0) {
+			locker_error(locker, "flock(%s.lock) failed: %m",
+				     locker->path);
+			return -1;
+		}
+		break;
+#endif
+	case LOCK_BENCH_METHOD_DOTLOCK:
+		snprintf(dotlock_path, sizeof(dotlock_path), "%s.dotlock",
+			 locker->path);
+		if (!lock) {
+			if (unlink(dotlock_path) < 0) {
+				locker_error(locker, "unlink(%s) failed: %m",
+					     dotlock_path);
+				return -1;
+			}
+			break;
+		}
+		/* O_EXCL works with NFSv3 and later. poll with a small
+		   random delay like Dovecot's dotlocks do. */
+		while ((fd = nfs_safe_create(dotlock_path, O_WRONLY | O_CREAT |
+					     O_EXCL, 0600)) == -1) {
+			if (errno != EEXIST) {
+				locker_error(locker, "creat(%s) failed: %m",
+					     dotlock_path);
+				return -1;
+			}
+			/* e.g. a failed unlink() left the dotlock behind */
+			if (clock_usecs() >= end_usecs)
+				return -1;
+			usleep(DOTLOCK_RETRY_USECS / 2 +
+			       rand_r(&locker->seed) % DOTLOCK_RETRY_USECS);
+		}
+		close(fd);
+		break;
+	case LOCK_BENCH_METHOD_COUNT:
+		abort();
+	}
+	return 0;
+}
+
+/* Lock and unlock until the duration is over. Failed locks are counted
+   as errors, not acquisitions. */
+static void locker_run(struct locker *locker)
+{
+	unsigned long long start, now, end;
+
+	start = clock_usecs();
+	end = start + locker->duration_msecs * 1000ULL;
+	for (now = start; now < end; start = now) {
+		if (locker_lock(locker, 1, end) < 0) {
+			now = clock_usecs();
+			continue;
+		}
+		now = clock_usecs();
+		latency_add(&locker->wait, now - start);
+		locker->ops++;
+		(void)locker_lock(locker, 0, end);
+		now = clock_usecs();
+	}
+	if (locker->fd != -1)
+		close(locker->fd);
+}
+
+static void *locker_thread(void *context)
+{
+	struct locker *locker = context;
+
+	locker_open(locker);
+	agents_barrier_wait(1);
+
+	locker_run(locker);
+	return NULL;
+}
+
+/* Run one round with count lockers, the remote ones first. Each locker's
+   results are in lockers[]. */
+static void locks_round(const int *remote_fds, unsigned int remote_count,
+			unsigned int count, const char *path,
+			enum lock_bench_method method, struct locker *lockers)
+{
+	char buf[1024], *line;
+	unsigned int i, remote_n;
+	int fd, len;
+
+	remote_n = count < remote_count ? count : remote_count;
+	snprintf(buf, sizeof(buf), "%s.lock", path);
+	fd = nfs_safe_create(buf, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", buf);
+	close(fd);
+	snprintf(buf, sizeof(buf), "%s.dotlock", path);
+	if (unlink(buf) < 0 && errno != ENOENT)
+		i_fatal("unlink(%s) failed: %m", buf);
+
+	snprintf(buf, sizeof(buf), "%s %u\n",
+		 lock_bench_method_names[method], agents_duration_msecs);
+	for (i = 0; i < remote_n; i++) {
+		send_cmd(remote_fds[i], 'L');
+		write_full(remote_fds[i], buf, strlen(buf));
+	}
+	for (i = 0; i < remote_n; i++)
+		wait_cmd(remote_fds[i], '1');
+
+	memset(lockers, 0, sizeof(*lockers) * count);
+	agents_barrier_init();
+	for (i = remote_n; i < count; i++) {
+		lockers[i].path = path;
+		lockers[i].method = method;
+		lockers[i].seed = i + 1;
+		lockers[i].duration_msecs = agents_duration_msecs;
+		if (pthread_create(&lockers[i].thread, NULL,
+				   locker_thread, &lockers[i]) != 0)
+			i_fatal("pthread_create() failed");
+	}
+	(void)agents_barrier_start(remote_fds, remote_n, count - remote_n);
+
+	for (i = remote_n; i < count; i++)
+		pthread_join(lockers[i].thread, NULL);
+	for (i = 0; i < remote_n; i++) {
+		/* "<ops> <errors>" followed by the wait latency */
+		line = read_line(remote_fds[i]);
+		if (sscanf(line, "%llu %llu%n", &lockers[i].ops,
+			   &lockers[i].errors, &len) != 2 ||
+		    latency_parse(line + len, &lockers[i].wait) == NULL)
+			i_fatal("Invalid locker stats: %s", line);
+		free(line);
+		wait_cmd(remote_fds[i], '!');
+	}
+}
+
+static void nfs_test_locks_server(int socket_fd, const char *path)
+{
+	struct locker *locker;
+	char *line, name[32], buf[32];
+
+	locker = calloc(1, sizeof(*locker));
+	if (locker == NULL)
+		i_fatal("calloc() failed: %m");
+	line = read_line(socket_fd);
+	if (sscanf(line, "%31s %u", name, &locker->duration_msecs) != 2)
+		i_fatal("Invalid lock benchmark parameters: %s", line);
+	free(line);
+	for (locker->method = 0; locker->method < LOCK_BENCH_METHOD_COUNT;
+	     locker->method++) {
+		if (strcmp(lock_bench_method_names[locker->method], name) == 0)
+			break;
+	}
+	if (locker->method == LOCK_BENCH_METHOD_COUNT)
+		i_fatal("Unsupported lock method: %s", name);
+	locker->path = path;
+	locker->seed = getpid();
+	locker_open(locker);
+
+	send_cmd(socket_fd, '1');
+	wait_cmd(socket_fd, '2');
+	locker_run(locker);
+	snprintf(buf, sizeof(buf), "%llu %llu", locker->ops, locker->errors);
+	write_full(socket_fd, buf, strlen(buf));
+	latency_send(socket_fd, &locker->wait);
+	write_full(socket_fd, "\n", 1);
+	free(locker);
+}
+
+static void nfs_test_locks_client(int socket_fd, const char *path)
+{
+	int remote_fds[AGENTS_MAX_REMOTE + 1];
+	struct locker *lockers;
+	struct latency *wait;
+	unsigned long long ops, min_ops, max_ops, errors;
+	unsigned int i, method, count, remote_count;
+	double secs, sum_sq, fairness;
+	const char *names[9];
+	double values[9];
+	char buf[1024];
+
+	printf("\nTesting lock contention..\n");
+	remote_count = agents_connect(socket_fd, remote_fds);
+	count = agents_max;
+	lockers = calloc(count, sizeof(*lockers));
+	wait = calloc(1, sizeof(*wait));
+	if (lockers == NULL || wait == NULL)
+		i_fatal("calloc() failed: %m");
+
+	printf("%-8s %7s %9s %23s %8s %15s %6s\n", "method", "lockers",
+	       "acq/s", "wait p50/p99/max", "fairness", "min/max acq",
+	       "errors");
+	for (method = 0; method < LOCK_BENCH_METHOD_COUNT; method++) {
+		locks_round(remote_fds, remote_count, count, path, method,
+			    lockers);
+
+		memset(wait, 0, sizeof(*wait));
+		ops = max_ops = errors = 0; min_ops = ~0ULL; sum_sq = 0;
+		for (i = 0; i < count; i++) {
+			latency_merge(wait, &lockers[i].wait);
+			ops += lockers[i].ops;
+			errors += lockers[i].errors;
+			sum_sq += (double)lockers[i].ops * lockers[i].ops;
+			if (lockers[i].ops < min_ops)
+				min_ops = lockers[i].ops;
+			if (lockers[i].ops > max_ops)
+				max_ops = lockers[i].ops;
+		}
+		/* Jain's fairness index: 1 = everyone got the lock equally
+		   often, 1/lockers = one locker got it every time */
+		fairness = sum_sq == 0 ? 0 : (double)ops * ops / (count * sum_sq);
+		secs = agents_duration_msecs / 1000.0;
+
+		printf("%-8s %7u %9.1f %7llu/%7llu/%7llu %8.3f %7llu/%-7llu "
+		       "%6llu\n", lock_bench_method_names[method], count,
+		       ops / secs, latency_percentile(wait, 50),
+		       latency_percentile(wait, 99), wait->max, fairness,
+		       min_ops, max_ops, errors);
+
+		names[0] = "lockers"; values[0] = count;
+		names[1] = "acquisitions_per_sec"; values[1] = ops / secs;
+		names[2] = "wait_p50_usecs";
+		values[2] = latency_percentile(wait, 50);
+		names[3] = "wait_p99_usecs";
+		values[3] = latency_percentile(wait, 99);
+		names[4] = "wait_max_usecs";
+		values[4] = wait->max;
+		names[5] = "fairness"; values[5] = fairness;
+		names[6] = "min_acquisitions"; values[6] = min_ops;
+		names[7] = "max_acquisitions"; values[7] = max_ops;
+		names[8] = "errors"; values[8] = errors;
+		result_write_values("locks", lock_bench_method_names[method],
+				    names, values, 9);
+	}
+	printf("(usecs, fairness = Jain's index over the lockers' "
+	       "acquisition counts)\n");
+	free(lockers);
+	free(wait);
+
+	snprintf(buf, sizeof(buf), "%s.lock", path);
+	if (unlink(buf) < 0)
+		i_error("unlink(%s) failed: %m", buf);
+	agents_disconnect(remote_fds, remote_count);
+}
+
+static void nfs_test_change_detect_server(int socket_fd, const char *path)
+{
+	unsigned long long end, seq = 0;
+	unsigned int duration_msecs, seed = getpid();
+	char buf[CHANGE_FILE_SIZE], *line;
+	int fd;
+
+	line = read_line(socket_fd);
+	duration_msecs = strtoul(line, NULL, 10);
+	free(line);
+
+	fd = nfs_safe_create(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		i_fatal("creat(%s) failed: %m", path);
+	memset(buf, 0, sizeof(buf));
+	write_full(fd, buf, sizeof(buf));
+	if (fsync(fd) < 0)
+		i_fatal("fsync(%s) failed: %m", path);
+	send_cmd(socket_fd, '1');
+	wait_cmd(socket_fd, '2');
+
+	/* overwrite in place, so only the timestamps change */
+	end = clock_usecs() + duration_msecs * 1000ULL;
+	while (clock_usecs() < end) {
+		seq++;
+		if (pwrite(fd, &seq, sizeof(seq), 0) != sizeof(seq))
+			i_fatal("pwrite(%s) failed: %m", path);
+		if (fsync(fd) < 0)
+			i_fatal("fsync(%s) failed: %m", path);
+		send_cmd(socket_fd, 'w');
+		usleep(rand_r(&seed) % (CHANGE_WRITE_INTERVAL_USECS * 2));
+	}
+	send_cmd(socket_fd, '.');
+	wait_cmd(socket_fd, '3');
+	close(fd);
+}
+
+/* The detector's timestamp truncated to its resolution, in nanoseconds */
+static unsigned long long
+change_detector_stamp(const struct stat *st, unsigned int detector)
+{
+	static const unsigned long long divs[] = { 1000000000, 1000, 1 };
+	unsigned long long secs, nsecs, div = divs[detector % 3];
+
+	if (detector < CHANGE_DETECTOR_CTIME_SECS) {
+		secs = st->st_mtime;
+		nsecs = ST_NSECS(*st);
+	} else {
+		secs = st->st_ctime;
+		nsecs = ST_CTIME_NSECS(*st);
+	}
+	return secs * 1000000000ULL + nsecs / div * div;
+}
+
+/* A stat() that ended at now_usecs returned stamp. If it changed, all the
+   writes notified so far count as detected. */
+static void
+change_detector_update(struct change_detector *det, unsigned long long stamp,
+		       const unsigned long long *notify_usecs,
+		       unsigned int notified, unsigned long long now_usecs)
+{
+	if (stamp == det->stamp)
+		return;
+	det->stamp = stamp;
+	if (det->detected == notified) {
+		/* seen before the server's notification arrived */
+		det->early++;
+		return;
+	}
+	for (; det->detected < notified; det->detected++) {
+		latency_add(&det->latency,
+			    now_usecs - notify_usecs[det->detected]);
+	}
+}
+
+static void nfs_test_change_detect_client(int socket_fd, const char *path)
+{
+	struct change_detector *detectors, *det;
+	struct rpc_stats rpcs, rpcs_after;
+	struct latency *poll_lat;
+	unsigned long long *notify_usecs = NULL, start, now, settle_end = 0;
+	unsigned int i, missed, notified = 0, notify_alloc = 0;
+	const char *names[8], *best = NULL;
+	double values[8], rpcs_per_poll = 0;
+	char buf[256];
+	struct stat st;
+	ssize_t ret, j;
+	int end_seen = 0;
+
+	printf("\nTesting change detection with stat()..\n");
+	detectors = calloc(CHANGE_DETECTOR_COUNT, sizeof(*detectors));
+	poll_lat = calloc(1, sizeof(*poll_lat));
+	if (detectors == NULL || poll_lat == NULL)
+		i_fatal("calloc() failed: %m");
+
+	send_cmd(socket_fd, 'T');
+	snprintf(buf, sizeof(buf), "%u\n", bench_duration_msecs);
+	write_full(socket_fd, buf, strlen(buf));
+	wait_cmd(socket_fd, '1');
+
+	nfs_cache_flush_before(path, NULL, CHANGE_FLUSH_METHOD);
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	for (i = 0; i < CHANGE_DETECTOR_COUNT; i++)
+		detectors[i].stamp = change_detector_stamp(&st, i);
+	(void)rpc_stats_read(&rpcs);
+	send_cmd(socket_fd, '2');
+
+	for (;;) {
+		/* collect the writes the server has finished by now */
+		while ((ret = recv(socket_fd, buf, sizeof(buf),
+				   MSG_DONTWAIT)) > 0) {
+			now = clock_usecs();
+			for (j = 0; j < ret; j++) {
+				if (buf[j] == '.') {
+					end_seen = 1;
+					settle_end = now +
+						CHANGE_SETTLE_MSECS * 1000ULL;
+					continue;
+				}
+				if (buf[j] != 'w')
+					i_fatal("Unexpected command: %c", buf[j]);
+				if (notified == notify_alloc) {
+					notify_alloc = notify_alloc == 0 ? 1024 :
+						notify_alloc * 2;
+					notify_usecs = realloc(notify_usecs,
+						sizeof(*notify_usecs) * notify_alloc);
+					if (notify_usecs == NULL)
+						i_fatal("realloc() failed: %m");
+				}
+				notify_usecs[notified] = now;
+				for (i = 0; i < CHANGE_DETECTOR_COUNT; i++) {
+					det = &detectors[i];
+					if (det->early > 0 &&
+					    det->detected == notified) {
+						det->early--;
+						det->detected++;
+						latency_add(&det->latency, 0);
+					}
+				}
+				notified++;
+			}
+		}
+		if (ret == 0)
+			i_fatal("Connection lost");
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			i_fatal("recv() failed: %m");
+		if (end_seen && clock_usecs() >= settle_end)
+			break;
+
+		start = clock_usecs();
+		nfs_cache_flush_before(path, NULL, CHANGE_FLUSH_METHOD);
+		if (stat(path, &st) < 0)
+			i_fatal("stat(%s) failed: %m", path);
+		now = clock_usecs();
+		latency_add(poll_lat, now - start);
+		for (i = 0; i < CHANGE_DETECTOR_COUNT; i++) {
+			change_detector_update(&detectors[i],
+					       change_detector_stamp(&st, i),
+					       notify_usecs, notified, now);
+		}
+	}
+	send_cmd(socket_fd, '3');
+	if (rpc_stats_read(&rpcs_after) == 0 && rpcs.count > 0) {
+		rpc_stats_diff(&rpcs, &rpcs_after);
+		rpcs_per_poll = (double)rpc_stats_total(&rpcs) / poll_lat->count;
+	} else {
+		rpcs.count = 0;
+	}
+
+	printf("%u writes, %llu polls, poll p50/p99 %llu/%llu usecs",
+	       notified, poll_lat->count, latency_percentile(poll_lat, 50),
+	       latency_percentile(poll_lat, 99));
+	if (rpcs.count > 0)
+		printf(", %.2f RPCs per poll", rpcs_per_poll);
+	printf("\n");
+	names[0] = "writes"; values[0] = notified;
+	names[1] = "polls"; values[1] = poll_lat->count;
+	names[2] = "poll_p50_usecs"; values[2] = latency_percentile(poll_lat, 50);
+	names[3] = "poll_p99_usecs"; values[3] = latency_percentile(poll_lat, 99);
+	names[4] = "rpcs_per_poll"; values[4] = rpcs_per_poll;
+	result_write_values("change_detect", "poll", names, values,
+			    rpcs.count > 0 ? 5 : 4);
+
+	printf("%-12s %8s %8s %10s %10s %10s  %s\n", "stamp", "missed",
+	       "missed%", "p50", "p99", "max", "safe re-scan interval");
+	for (i = 0; i < CHANGE_DETECTOR_COUNT; i++) {
+		det = &detectors[i];
+		missed = notified - det->detected;
+		printf("%-12s %8u %7.2f%% %10llu %10llu %10llu  ",
+		       change_detector_names[i], missed,
+		       notified == 0 ? 0 : missed * 100.0 / notified,
+		       latency_percentile(&det->latency, 50),
+		       latency_percentile(&det->latency, 99),
+		       det->latency.max);
+		if (notified == 0)
+			printf("-\n");
+		else if (missed > 0)
+			printf("unsafe, the last changes were never seen\n");
+		else {
+			printf(">= %.1f ms\n",
+			       det->latency.max / 1000.0);
+			if (best == NULL)
+				best = change_detector_names[i];
+		}
+
+		names[0] = "writes"; values[0] = notified;
+		names[1] = "missed"; values[1] = missed;
+		names[2] = "missed_pct";
+		values[2] = notified == 0 ? 0 : missed * 100.0 / notified;
+		names[3] = "p50_usecs";
+		values[3] = latency_percentile(&det->latency, 50);
+		names[4] = "p90_usecs";
+		values[4] = latency_percentile(&det->latency, 90);
+		names[5] = "p99_usecs";
+		values[5] = latency_percentile(&det->latency, 99);
+		names[6] = "p999_usecs";
+		values[6] = latency_percentile(&det->latency, 99.9);
+		names[7] = "max_usecs";
+		values[7] = det->latency.max;
+		result_write_latency("change_detect", change_detector_names[i],
+				     names, values, 8, &det->latency);
+	}
+	printf("(visibility latency usecs, flush = %s)\n",
+	       nfs_cache_flush_method_names[CHANGE_FLUSH_METHOD]);
+	if (best == NULL) {
+		printf("No timestamp saw every change: a file whose stamp "
+		       "is as new as the last write can still change "
+		       "unnoticed, so such files must be re-read until the "
+		       "stamp is older than its resolution.\n");
+	} else {
+		printf("Changes were always seen by %s, at the latest after "
+		       "the safe re-scan interval.\n", best);
+	}
+
+	free(notify_usecs);
+	free(poll_lat);
+	free(detectors);
+	wait_cmd(socket_fd, '!');
+}
+
+static void visibility_write(const char *path, unsigned long long seq)
+{
+	char buf[VISIBILITY_RECORD_SIZE + 1];
+	int fd;
+
+	/* close-to-open: the write is flushed to the server by close() */
+	snprintf(buf, sizeof(buf), "%0*llu\n", VISIBILITY_RECORD_SIZE - 1, seq);
+	fd = nfs_safe_create(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		i_fatal("creat(%s) failed: %m", path);
+	if (pwrite(fd, buf, VISIBILITY_RECORD_SIZE, 0) != VISIBILITY_RECORD_SIZE)
+		i_fatal("pwrite(%s) failed: %m", path);
+	if (close(fd) < 0)
+		i_fatal("close(%s) failed: %m", path);
+}
+
+static void nfs_test_visibility_server(int socket_fd, const char *path)
+{
+	unsigned long long end, seq;
+	unsigned int duration_msecs, rounds;
+	char *line;
+
+	line = read_line(socket_fd);
+	if (sscanf(line, "%u %u", &duration_msecs, &rounds) != 2)
+		i_fatal("Invalid visibility parameters: %s", line);
+	free(line);
+
+	for (; rounds > 0; rounds--) {
+		if (unlink(path) < 0 && errno != ENOENT)
+			i_fatal("unlink(%s) failed: %m", path);
+		visibility_write(path, 0);
+		send_cmd(socket_fd, '1');
+		wait_cmd(socket_fd, '2');
+
+		end = clock_usecs() + duration_msecs * 1000ULL;
+		for (seq = 1; clock_usecs() < end; seq++) {
+			visibility_write(path, seq);
+			send_cmd(socket_fd, 'w');
+		}
+		send_cmd(socket_fd, '.');
+		wait_cmd(socket_fd, '3');
+	}
+}
+
+/* Read the latest record. Returns 0 if the read was short. */
+static unsigned long long visibility_read(int fd, const char *path)
+{
+	char buf[VISIBILITY_RECORD_SIZE + 1];
+	ssize_t ret;
+
+	ret = pread(fd, buf, VISIBILITY_RECORD_SIZE, 0);
+	if (ret < 0)
+		i_fatal("pread(%s) failed: %m", path);
+	if (ret != VISIBILITY_RECORD_SIZE)
+		return 0;
+	buf[ret] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+/* Poll the test file for one round, reopening it for each read or not */
+static void visibility_round(int socket_fd, const char *path, int reopen)
+{
+	const char *mode = reopen ? "open+read" : "read";
+	unsigned long long *notify_usecs = NULL, seq, visible = 0, stale = 0;
+	unsigned long long now, settle_end = 0, reads = 0, notified = 0;
+	unsigned long long notify_alloc = 0;
+	struct latency *lat;
+	const char *names[9];
+	double values[9];
+	char buf[256];
+	ssize_t ret, i;
+	int fd = -1, end_seen = 0;
+
+	lat = calloc(1, sizeof(*lat));
+	if (lat == NULL)
+		i_fatal("calloc() failed: %m");
+	wait_cmd(socket_fd, '1');
+	if (!reopen) {
+		fd = nfs_safe_open(path, O_RDONLY);
+		if (fd < 0)
+			i_fatal("open(%s) failed: %m", path);
+	}
+	send_cmd(socket_fd, '2');
+
+	for (;;) {
+		/* collect the writes the server has finished by now.
+		   notify_usecs[n] is the time of seq n+1. */
+		while ((ret = recv(socket_fd, buf, sizeof(buf),
+				   MSG_DONTWAIT)) > 0) {
+			now = clock_usecs();
+			for (i = 0; i < ret; i++) {
+				if (buf[i] == '.') {
+					end_seen = 1;
+					settle_end = now +
+						VISIBILITY_SETTLE_MSECS * 1000ULL;
+					continue;
+				}
+				if (buf[i] != 'w')
+					i_fatal("Unexpected command: %c", buf[i]);
+				if (notified == notify_alloc) {
+					notify_alloc = notify_alloc == 0 ? 1024 :
+						notify_alloc * 2;
+					notify_usecs = realloc(notify_usecs,
+						sizeof(*notify_usecs) * notify_alloc);
+					if (notify_usecs == NULL)
+						i_fatal("realloc() failed: %m");
+				}
+				notify_usecs[notified++] = now;
+				/* already read before the notification */
+				if (notified <= visible)
+					latency_add(lat, 0);
+			}
+		}
+		if (ret == 0)
+			i_fatal("Connection lost");
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			i_fatal("recv() failed: %m");
+		if (end_seen && (visible >= notified ||
+				 clock_usecs() >= settle_end))
+			break;
+
+		if (reopen) {
+			fd = nfs_safe_open(path, O_RDONLY);
+			if (fd < 0)
+				i_fatal("open(%s) failed: %m", path);
+		}
+		seq = visibility_read(fd, path);
+		if (reopen)
+			close(fd);
+		now = clock_usecs();
+		reads++;
+		/* stale if an older write than the last finished one */
+		if (seq < notified)
+			stale++;
+		for (; visible < seq; visible++) {
+			if (visible < notified)
+				latency_add(lat, now - notify_usecs[visible]);
+		}
+	}
+	send_cmd(socket_fd, '3');
+	if (!reopen)
+		close(fd);
+
+	printf("%-10s %9llu %9llu %8.2f%% %9llu %9llu %9llu %9llu %7llu\n",
+	       mode, notified, reads,
+	       reads == 0 ? 0 : stale * 100.0 / reads,
+	       latency_percentile(lat, 50), latency_percentile(lat, 90),
+	       latency_percentile(lat, 99), lat->max,
+	       notified - (visible < notified ? visible : notified));
+
+	names[0] = "writes"; values[0] = notified;
+	names[1] = "reads"; values[1] = reads;
+	names[2] = "stale_pct"; values[2] = reads == 0 ? 0 : stale * 100.0 / reads;
+	names[3] = "p50_usecs"; values[3] = latency_percentile(lat, 50);
+	names[4] = "p90_usecs"; values[4] = latency_percentile(lat, 90);
+	names[5] = "p99_usecs"; values[5] = latency_percentile(lat, 99);
+	names[6] = "p999_usecs"; values[6] = latency_percentile(lat, 99.9);
+	names[7] = "max_usecs"; values[7] = lat->max;
+	names[8] = "never_visible";
+	values[8] = notified - (visible < notified ? visible : notified);
+	result_write_latency("visibility", mode, names, values, 9, lat);
+	free(notify_usecs);
+	free(lat);
+}
+
+static void nfs_test_visibility_client(int socket_fd, const char *path)
+{
+	char buf[64];
+
+	printf("\nTesting write visibility without flushing..\n");
+	if (rpc_mount_opts[0] != '\0')
+		printf("Mount options: %s\n", rpc_mount_opts);
+	send_cmd(socket_fd, 'V');
+	snprintf(buf, sizeof(buf), "%u 2\n", bench_duration_msecs);
+	write_full(socket_fd, buf, strlen(buf));
+
+	printf("%-10s %9s %9s %9s %9s %9s %9s %9s %7s\n", "mode", "writes",
+	       "reads", "stale", "p50", "p90", "p99", "max", "unseen");
+	visibility_round(socket_fd, path, 1);
+	visibility_round(socket_fd, path, 0);
+	printf("(propagation delay usecs, from the write's close() to the "
+	       "first read that returned it)\n");
+	wait_cmd(socket_fd, '!');
+}
+
+static void nfs_test_dir_scan_server(int socket_fd, const char *path)
+{
+	char dir[1024], file_path[1024 + 64], *line;
+	unsigned int i, count;
+	int fd;
+
+	line = read_line(socket_fd);
+	count = strtoul(line, NULL, 10);
+	free(line);
+
+	snprintf(dir, sizeof(dir), "%s.dir", path);
+	bench_dir_remove(dir);
+	if (mkdir(dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	for (i = 0; i < count; i++) {
+		snprintf(file_path, sizeof(file_path),
+			 "%s/%u.M%uP%ld.nfstest:2,S", dir, 1234567890 + i, i,
+			 (long)getpid());
+		fd = nfs_safe_create(file_path, O_WRONLY | O_CREAT | O_EXCL,
+				     0600);
+		if (fd == -1)
+			i_fatal("creat(%s) failed: %m", file_path);
+		close(fd);
+	}
+	send_cmd(socket_fd, '1');
+	wait_cmd(socket_fd, '2');
+	bench_dir_remove(dir);
+}
+
+static void *dir_scan_stat_thread(void *context)
+{
+	struct dir_scan_thread *thread = context;
+	struct dir_scan *scan = thread->scan;
+	unsigned int i;
+	struct stat st;
+#ifdef HAVE_STATX
+	struct statx stx;
+#endif
+	int ret;
+
+	for (i = thread->idx; i < scan->count; i += scan->threads) {
+		switch (scan->mode) {
+		case DIR_SCAN_MODE_STAT:
+			ret = fstatat(scan->dir_fd, scan->names[i], &st,
+				      AT_SYMLINK_NOFOLLOW);
+			break;
+#ifdef HAVE_STATX
+		case DIR_SCAN_MODE_STATX_TYPE:
+			ret = statx(scan->dir_fd, scan->names[i],
+				    AT_SYMLINK_NOFOLLOW,
+				    STATX_TYPE | STATX_INO, &stx);
+			break;
+		case DIR_SCAN_MODE_STATX_MTIME:
+			ret = statx(scan->dir_fd, scan->names[i],
+				    AT_SYMLINK_NOFOLLOW,
+				    STATX_SIZE | STATX_MTIME, &stx);
+			break;
+#endif
+		default:
+			abort();
+		}
+		/* the file may have been deleted meanwhile */
+		if (ret < 0 && errno != ENOENT)
+			i_fatal("stat(%s/%s) failed: %m",
+				scan->dir, scan->names[i]);
+	}
+	return NULL;
+}
+
+/* readdir() the directory, and stat the entries if the mode needs it */
+static void dir_scan_run(struct dir_scan *scan)
+{
+	struct dir_scan_thread threads[DIR_SCAN_MAX_THREADS];
+	struct dirent *d;
+	unsigned int i;
+	DIR *dirp;
+
+	dirp = opendir(scan->dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", scan->dir);
+	scan->count = 0;
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+		    (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+			continue;
+		if (scan->mode == DIR_SCAN_MODE_READDIR) {
+			scan->count++;
+			continue;
+		}
+		if (strlen(d->d_name) >= sizeof(scan->names[0]))
+			continue;
+		if (scan->count == scan->alloc) {
+			scan->alloc = scan->alloc == 0 ? 1024 : scan->alloc * 2;
+			scan->names = realloc(scan->names,
+					      sizeof(*scan->names) * scan->alloc);
+			if (scan->names == NULL)
+				i_fatal("realloc() failed: %m");
+		}
+		strcpy(scan->names[scan->count++], d->d_name);
+	}
+	closedir(dirp);
+	if (scan->mode == DIR_SCAN_MODE_READDIR)
+		return;
+
+	if (scan->threads == 1) {
+		threads[0].scan = scan;
+		threads[0].idx = 0;
+		(void)dir_scan_stat_thread(&threads[0]);
+		return;
+	}
+	for (i = 0; i < scan->threads; i++) {
+		threads[i].scan = scan;
+		threads[i].idx = i;
+		if (pthread_create(&threads[i].thread, NULL,
+				   dir_scan_stat_thread, &threads[i]) != 0)
+			i_fatal("pthread_create() failed");
+	}
+	for (i = 0; i < scan->threads; i++)
+		pthread_join(threads[i].thread, NULL);
+}
+
+static void nfs_test_dir_scan_client(int socket_fd, const char *path)
+{
+	struct dir_scan scan;
+	struct rpc_stats rpcs, rpcs_after;
+	enum nfs_cache_flush_method method;
+	unsigned long long start, usecs;
+	unsigned int i, f, r, mode, thread_counts[2];
+	const char *names[6];
+	double values[6], rpcs_per_scan;
+	char dir[1024], buf[64], variant[128];
+
+	printf("\nTesting directory scans (%u files)..\n", dir_scan_files);
+	send_cmd(socket_fd, 'R');
+	snprintf(buf, sizeof(buf), "%u\n", dir_scan_files);
+	write_full(socket_fd, buf, strlen(buf));
+	wait_cmd(socket_fd, '1');
+
+	memset(&scan, 0, sizeof(scan));
+	snprintf(dir, sizeof(dir), "%s.dir", path);
+	scan.dir = dir;
+	scan.dir_fd = open(dir, O_RDONLY);
+	if (scan.dir_fd == -1)
+		i_fatal("open(%s) failed: %m", dir);
+	/* don't let the first variant pay for the initial lookups */
+	scan.mode = DIR_SCAN_MODE_STAT;
+	scan.threads = 1;
+	dir_scan_run(&scan);
+	if (scan.count != dir_scan_files) {
+		i_error("Directory scan found %u files instead of %u",
+			scan.count, dir_scan_files);
+	}
+
+	thread_counts[0] = 1;
+	thread_counts[1] = dir_scan_threads;
+	printf("%-18s %-18s %7s %10s %9s", "flush", "mode", "threads",
+	       "entries/s", "ms/scan");
+	if (rpc_mountpoint[0] != '\0')
+		printf(" %9s", "rpcs/scan");
+	printf("\n");
+	for (f = 0; f < DIR_SCAN_FLUSH_METHOD_COUNT; f++) {
+		method = dir_scan_flush_methods[f];
+		for (mode = 0; mode < DIR_SCAN_MODE_COUNT; mode++) {
+			for (i = 0; i < 2; i++) {
+				/* readdir alone can't be split to threads */
+				if (i == 1 && (thread_counts[1] == 1 ||
+					       mode == DIR_SCAN_MODE_READDIR))
+					break;
+				scan.mode = mode;
+				scan.threads = thread_counts[i];
+
+				usecs = 0;
+				(void)rpc_stats_read(&rpcs);
+				for (r = 0; r < DIR_SCAN_ROUNDS; r++) {
+					nfs_cache_flush_before(dir, &scan.dir_fd,
+							       method);
+					nfs_cache_flush_after(dir, &scan.dir_fd,
+							      method);
+					start = clock_usecs();
+					dir_scan_run(&scan);
+					usecs += clock_usecs() - start;
+				}
+				if (rpc_stats_read(&rpcs_after) == 0 &&
+				    rpcs.count > 0)
+					rpc_stats_diff(&rpcs, &rpcs_after);
+				else
+					rpcs.count = 0;
+				rpcs_per_scan = (double)rpc_stats_total(&rpcs) /
+					DIR_SCAN_ROUNDS;
+
+				values[0] = scan.count;
+				values[1] = scan.threads;
+				values[2] = usecs == 0 ? 0 :
+					scan.count * DIR_SCAN_ROUNDS *
+					1000000.0 / usecs;
+				values[3] = usecs / 1000.0 / DIR_SCAN_ROUNDS;
+				values[4] = rpcs_per_scan;
+				printf("%-18s %-18s %7u %10.0f %9.2f",
+				       nfs_cache_flush_method_names[method],
+				       dir_scan_mode_names[mode], scan.threads,
+				       values[2], values[3]);
+				if (rpcs.count > 0)
+					printf(" %9.1f", rpcs_per_scan);
+				printf("\n");
+
+				names[0] = "entries"; names[1] = "threads";
+				names[2] = "entries_per_sec";
+				names[3] = "msecs_per_scan";
+				names[4] = "rpcs_per_scan";
+				snprintf(variant, sizeof(variant),
+					 "%s, %u threads, %s",
+					 dir_scan_mode_names[mode], scan.threads,
+					 nfs_cache_flush_method_names[method]);
+				result_write_values("dir_scan", variant,
+						    names, values,
+						    rpcs.count > 0 ? 5 : 4);
+			}
+		}
+	}
+	printf("(flush = dir cache flush before each scan, %u scans each)\n",
+	       DIR_SCAN_ROUNDS);
+
+	close(scan.dir_fd);
+	free(scan.names);
+	send_cmd(socket_fd, '2');
+	wait_cmd(socket_fd, '!');
+}
+
+struct command {
+	char cmd;
+	void (*server)(int fd, const char *path);
+	void (*client)(int fd, const char *path);
+	/* benchmarks are run only when explicitly requested */
+	int benchmark;
+};
+
+#define ENTRY(cmd, func) \
+	{ cmd, nfs_test_ ## func ## _server, nfs_test_ ## func ## _client, 0 }
+#define BENCHMARK_ENTRY(cmd, func) \
+	{ cmd, nfs_test_ ## func ## _server, nfs_test_ ## func ## _client, 1 }
+#define N_COMMANDS (sizeof(commands)/sizeof(commands[0]))
+static struct command commands[] = {
+	ENTRY('S', estale),
+	ENTRY('E', oexcl),
+	ENTRY('N', nsecs),
+	ENTRY('F', fattrcache),
+	ENTRY('D', data_cache),
+	ENTRY('W', write_flush),
+	ENTRY('P', write_partial),
+	ENTRY('H', fhandlecache),
+	BENCHMARK_ENTRY('A', agents),
+	BENCHMARK_ENTRY('M', maildir),
+	BENCHMARK_ENTRY('B', mdbox),
+	BENCHMARK_ENTRY('I', index),
+	BENCHMARK_ENTRY('L', locks),
+	BENCHMARK_ENTRY('T', change_detect),
+	BENCHMARK_ENTRY('V', visibility),
+	BENCHMARK_ENTRY('R', dir_scan),
+	/* keep negative dir attr cache last so it won't break other tests */
+	ENTRY('G', neg_fhandlecache)
+};
+
+static struct command *command_find(char cmd)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_COMMANDS; i++) {
+		if (commands[i].cmd == cmd)
+			return &commands[i];
+	}
+	return NULL;
+}
+
+static void nfs_test_server(int fd, const char *path)
+{
+	struct command *cmd;
+
+	if (unlink(path) < 0 && errno != ENOENT)
+		i_fatal("unlink(%s) failed: %m", path);
+
+	send_cmd(fd, 'S');
+	wait_cmd(fd, 'C');
+	printf("Connected: Acting as test server\n");
+
+	for (;;) {
+		cmd = command_find(read_cmd(fd));
+		if (cmd == NULL)
+			break;
+
+		cmd->server(fd, path);
+		send_cmd(fd, '!');
+	}
+}
+
+static void nfs_test_client(int fd, const char *path, const char *cmdstr)
+{
+	struct rpc_stats rpcs, rpcs_after;
+	unsigned int i;
+
+	if (unlink(path) < 0 && errno != ENOENT)
+		i_fatal("unlink(%s) failed: %m", path);
+
+	send_cmd(fd, 'C');
+	wait_cmd(fd, 'S');
+	printf("Connected: Acting as test client\n");
+	rpc_stats_init(path);
+	result_write_run(path);
+
+	for (i = 0; i < N_COMMANDS; i++) {
+		if (cmdstr == NULL ? commands[i].benchmark :
+		    strchr(cmdstr, commands[i].cmd) == NULL)
+			continue;
+
+		(void)rpc_stats_read(&rpcs);
+		commands[i].client(fd, path);
+		if (rpc_stats_read(&rpcs_after) == 0 && rpcs.count > 0) {
+			rpc_stats_diff(&rpcs, &rpcs_after);
+			printf("RPCs sent by test '%c': %llu,",
+			       commands[i].cmd, rpc_stats_total(&rpcs));
+			rpc_stats_print(&rpcs, 1);
+			printf("\n");
+		}
+	}
+
+	send_cmd(fd, 'X');
+}
+
+static void nfs_listen(unsigned int port, const char *path, const char *cmdstr)
+{
+	struct sockaddr_in so;
+	socklen_t addrlen = sizeof(so);
 	int listen_fd, fd;
 
 	memset(&so, 0, sizeof(so));
@@ -1324,25 +4112,9 @@ static void nfs_listen(unsigned int port, const char *path, const char *cmdstr)
 static void nfs_connect(const char *host, unsigned int port, const char *path,
 			const char *cmdstr)
 {
-	struct sockaddr_in so;
-	struct hostent *hp;
 	int fd;
 
-	hp = gethostbyname(host);
-	if (hp == NULL || hp->h_addr_list[0] == NULL)
-		i_fatal("gethostbyname(%s) failed", host);
-
-	memset(&so, 0, sizeof(so));
-        so.sin_family = AF_INET;
-	so.sin_port = htons(port);
-	memcpy(&so.sin_addr.s_addr, hp->h_addr_list[0], 4);
-
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0)
-		i_fatal("socket() failed: %m");
-	if (connect(fd, (void *)&so, sizeof(so)) < 0)
-		i_fatal("connect() failed: %m");
-
+	fd = nfs_connect_fd(host, port);
 	if (!reverse)
 		nfs_test_client(fd, path, cmdstr);
 	else
@@ -1350,17 +4122,117 @@ static void nfs_connect(const char *host, unsigned int port, const char *path,
 	close(fd);
 }
 
-int main(int argc, char *argv[])
+static void nfs_local(const char *server_path, const char *path,
+		      const char *cmdstr)
 {
-	const char *p;
-	int listen = 1;
+	int fds[2], status;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		i_fatal("socketpair() failed: %m");
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		close(fds[0]);
+		/* write the banner immediately, not in the middle of the
+		   client's results when the buffer happens to fill up */
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		nfs_test_server(fds[1], server_path);
+		fflush(stdout);
+		_exit(0);
+	}
+	close(fds[1]);
+	nfs_test_client(fds[0], path, cmdstr);
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		i_fatal("Test server process failed");
+}
 
-	if (argc > 1 && strcmp(argv[1], "-rev") == 0) {
-		/* reverse client and server roles. just to simplify bypassing
-		   firewalls when testing different client kernels. */
+int main(int argc, char *argv[])
+{
+	const char *p, *result_path = NULL, *server_path = NULL;
+	int listen = 1, local = 0, fd;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-rev") == 0) {
+			/* reverse client and server roles. just to simplify
+			   bypassing firewalls when testing different client
+			   kernels. */
+			reverse = 1;
+		} else if (strcmp(argv[1], "-local") == 0) {
+			local = 1;
+		} else if (strcmp(argv[1], "-server-path") == 0 && argc > 2) {
+			server_path = argv[2];
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-iterations") == 0 && argc > 2) {
+			flush_iterations = atoi(argv[2]);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-agents") == 0 && argc > 2) {
+			agents_max = atoi(argv[2]);
+			if (agents_max == 0)
+				i_fatal("-agents must be at least 1");
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-agent-secs") == 0 && argc > 2) {
+			agents_duration_msecs = atoi(argv[2]) * 1000;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-agent") == 0 && argc > 2) {
+			if (agent_hosts_count == AGENTS_MAX_REMOTE)
+				i_fatal("Too many -agent parameters");
+			p = strrchr(argv[2], ':');
+			if (p == NULL)
+				i_fatal("-agent needs <host>:<port>");
+			agent_hosts[agent_hosts_count] =
+				strndup(argv[2], p - argv[2]);
+			agent_ports[agent_hosts_count++] = atoi(p + 1);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-bench-secs") == 0 && argc > 2) {
+			bench_duration_msecs = atoi(argv[2]) * 1000;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-bench-size") == 0 && argc > 2) {
+			bench_mail_size = atoi(argv[2]);
+			if (bench_mail_size == 0)
+				i_fatal("-bench-size must be at least 1");
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-dir-files") == 0 && argc > 2) {
+			dir_scan_files = atoi(argv[2]);
+			/* rmdir() flushing needs a non-empty directory */
+			if (dir_scan_files == 0)
+				i_fatal("-dir-files must be at least 1");
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-scan-threads") == 0 && argc > 2) {
+			dir_scan_threads = atoi(argv[2]);
+			if (dir_scan_threads == 0 ||
+			    dir_scan_threads > DIR_SCAN_MAX_THREADS) {
+				i_fatal("-scan-threads must be 1..%d",
+					DIR_SCAN_MAX_THREADS);
+			}
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "-tsv") == 0 ||
+			    strcmp(argv[1], "-json") == 0) && argc > 2) {
+			result_format = argv[1][1] == 't' ?
+				RESULT_FORMAT_TSV : RESULT_FORMAT_JSON;
+			result_path = argv[2];
+			argc--;
+			argv++;
+		} else {
+			break;
+		}
 		argc--;
 		argv++;
-		reverse = 1;
 	}
 
 	if (argv[1] != NULL) {
@@ -1372,11 +4244,40 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (listen && argc >= 3)
+	if (result_path == NULL)
+		;
+	else if (strcmp(result_path, "-") == 0) {
+		/* keep only the records in stdout, everything else that is
+		   printed goes to stderr */
+		fflush(stdout);
+		if ((fd = dup(STDOUT_FILENO)) < 0)
+			i_fatal("dup() failed: %m");
+		if ((result_file = fdopen(fd, "w")) == NULL)
+			i_fatal("fdopen() failed: %m");
+		if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			i_fatal("dup2() failed: %m");
+	} else if ((result_file = fopen(result_path, "w")) == NULL)
+		i_fatal("fopen(%s) failed: %m", result_path);
+
+	if (local && argc >= 2) {
+		nfs_local(server_path != NULL ? server_path : argv[1],
+			  argv[1], argv[2]);
+	} else if (local)
+		;
+	else if (listen && argc >= 3)
 		nfs_listen(atoi(argv[1]), argv[2], argv[3]);
 	else if (!listen && argc >= 4)
 		nfs_connect(argv[1], atoi(argv[2]), argv[3], argv[4]);
-	else
-		i_fatal("Usage: nfstest [<host>] <port> <path> [<commands>]");
+	if (local ? argc < 2 : argc < (listen ? 3 : 4)) {
+		i_fatal("Usage: nfstest [<options>] [<host>] <port> <path> [<commands>]\n"
+			"       nfstest [<options>] -local [-server-path <path>] "
+			"<path> [<commands>]\n"
+			"Options: [-rev] [-iterations <n>] [-tsv|-json <file>] "
+			"[-agents <n>] [-agent-secs <n>] [-agent <host>:<port>]\n"
+			"         [-bench-secs <n>] [-bench-size <bytes>] "
+			"[-dir-files <n>] [-scan-threads <n>]");
+	}
+	if (result_file != NULL)
+		fclose(result_file);
 	return 0;
 }
@@ -1,224 +1,4514 @@
 /*
-   gcc pop3test.c -o pop3test -Wall -W -I. -Isrc/lib -DHAVE_CONFIG_H src/lib/liblib.a
+   Put this file to Dovecot v2.3 sources' root directory. Dovecot must be
+   compiled before this. Then run:
+
+   gcc pop3test.c -o pop3test -Wall -W -DHAVE_CONFIG_H -I. -Isrc/lib \
+       -Isrc/lib-ssl-iostream src/lib-dovecot/.libs/libdovecot.so \
+       -Wl,-rpath,$PWD/src/lib-dovecot/.libs -lssl -lcrypto -lm \
+       -DPOP3TEST_REVISION=\"$(git rev-parse --short HEAD)\"
+
+   Load-tests both POP3 and (with --protocol imap) IMAP servers. The
+   protocols share the connection handling, scenarios and statistics.
+
+   Usage: pop3test [options], see usage() for the full list. For example:
+
+   pop3test --host 10.0.0.1,10.0.0.2 --clients 500 --duration 300 \
+            --users-file users.txt --scenario mix.txt
+
+   With --threads the clients are sharded across n worker processes, each
+   running its own ioloop. (Dovecot's lib isn't thread-safe, so the
+   "threads" are processes.) Statistics are kept in shared memory, one slot
+   per worker, and merged by the parent when reporting.
+
+   By default each finished session is immediately replaced by a new one
+   (closed loop), so the offered load drops when the server slows down.
+   With --rate new sessions are started at the given total rate regardless
+   of how the server is doing (open loop), and latencies are measured from
+   the time the session was supposed to start. --max-sessions limits the
+   number of concurrent sessions per worker; arrivals beyond it are counted
+   as dropped.
+
+   --users-file takes a file with one "username[:password]" per line. It's
+   mmap()ed once at startup and shared by all the workers. Without it the
+   usernames are generated from --user-template, whose two %u conversions
+   are filled with random numbers from the --users and --domains ranges.
+
+   --ssl connects with POP3S (port 995 by default) and --starttls issues
+   STLS after the banner. TLS handshake times are kept in their own
+   histograms, separately for full and resumed handshakes. With
+   --ssl-resume each worker offers the last session it got from the same
+   host, and --ssl-tickets no disables session tickets so that resumption
+   has to use the server's session cache. Server certificates aren't
+   verified.
+
+   RETR bodies aren't split into lines. The input buffer is scanned with
+   memchr() for the terminating "." line and skipped as a whole, so the
+   generator can keep up with large messages. The report includes RETR
+   body bytes and messages per second, both in total and as a per-session
+   throughput histogram.
+
+   Each session runs a scenario picked randomly by weight from the
+   --scenario file. The file has one scenario per line:
+
+   <weight> <name> <command>[:<messages>[:<lines>]] ...
+
+   for example
+
+   # 70% UIDL-only polls, 20% header downloads, 10% full downloads
+   70 poll UIDL
+   20 top  STAT TOP:all:0
+   10 full LIST RETR DELE:0.5
+
+   Commands are CAPA, STAT, LIST, UIDL, TOP, RETR, DELE, NOOP and RSET.
+   TOP, RETR and DELE are sent for all, first or last message or each
+   message with the given probability (default all), so they need STAT,
+   LIST or UIDL to run earlier in the scenario. TOP's <lines> defaults to
+   0. Login (and STLS) and QUIT are added automatically. Each step's
+   commands are pipelined, and the next step starts after all the replies
+   have been received. --pipeline-depth limits how many of a step's
+   per-message commands (TOP, RETR, DELE) can be waiting for a reply at a
+   time: 1 is strict request/response, 0 (default) sends all of them at
+   once like RFC 2449 PIPELINING allows. Compare the "<cmd>_step" rows,
+   which show how long the whole step took. Without --scenario the only
+   scenario is "STAT RETR:<retr-probability> DELE:<dele-probability>".
+
+   A progress line with the last interval's connections and sessions per
+   second, active sessions, session latency percentiles and errors by type
+   is written to stderr every --progress seconds. --metrics serves the
+   cumulative counters and latency summaries in Prometheus text format,
+   over HTTP on [<ip>:]<port> (localhost by default, IPv6 addresses as
+   [<ip>]:<port>) or, if the value contains '/', to anyone connecting to
+   that unix socket, e.g. for "socat - UNIX-CONNECT:<path>".
+
+   --serve runs a mock POP3 server in n forked processes next to the
+   generator and points the load at it, so the generator's own ceiling can
+   be measured without Dovecot. The server listens on the first --host IP
+   (with a kernel-chosen port unless --port is given), accepts any login
+   and returns the same synthetic mailbox of --serve-messages messages of
+   about --serve-message-size bytes for every user. All replies are built
+   once at startup and shared by the server processes. DELE isn't
+   remembered, TOP always returns only the headers and there's no TLS.
+   The server processes ignore SIGINT and are stopped only after the
+   generator's sessions have drained.
+
+   All the randomness comes from --seed (by default based on the time,
+   printed in the report). Each worker derives its own generator from it,
+   and every session gets its own generator seeded from the worker's in
+   the order the sessions are started, so the n-th session of each worker
+   always uses the same user, scenario and messages regardless of timing.
+   --manifest writes the parameters, seed, pop3test and Dovecot revisions,
+   the kernel and CPU, and the size and SHA-256 of the --users-file,
+   --scenario and --rawlog files to a file. "pop3test --replay <manifest>"
+   refuses to run if any of those files have changed, and otherwise runs
+   exactly the same workload again, e.g. against another Dovecot build.
+
+   The run has three phases: --ramp-up seconds during which the load grows
+   linearly from zero, the steady state of --duration seconds, and
+   --ramp-down seconds during which it shrinks back to zero. In closed
+   loop mode the number of concurrent sessions follows the ramp, in open
+   loop mode the arrival rate does. With ramps the statistics are kept and
+   reported separately for each phase, so warm-up effects don't contaminate
+   the steady state numbers. At the end (or on the first SIGINT/SIGTERM)
+   no new sessions are started and the report is printed once the running
+   ones have finished, or after --drain-timeout seconds. A second signal
+   stops immediately.
+
+   --rawlog <dir> replays POP3 sessions captured with Dovecot's rawlog
+   instead of running scenarios. Every *.in file in the directory, or in
+   its subdirectories as with rawlog_dir=<dir>/%u, is one session. The
+   files are mmap()ed and indexed into per-session command lists at
+   startup. The sessions are replayed in turn by each worker, using the
+   user from the subdirectory name or a captured USER command when there
+   is one. The login itself is always done by pop3test (USER/PASS/AUTH/
+   STLS lines are skipped), and QUIT is added if the capture doesn't end
+   with it. When the lines have rawlog timestamps, each command is sent
+   the original time after the previous one, multiplied by
+   --rawlog-scale (1 = original timing, 0 = no waiting). Commands are
+   sent one at a time, so captured pipelining is lost. The latencies are
+   reported per command as usual, and the sessions as scenario "rawlog".
+
+   --engine io_uring replaces Dovecot's ioloop/istream/ostream client with
+   a minimal one driven by io_uring, for generating login storms. Each
+   session only connects, waits for the banner, logs in with USER/PASS
+   and QUITs (reported as scenario "login"), so scenarios, rawlogs, TLS
+   and IMAP aren't supported. The connects, sends and recvs of everything
+   that becomes ready during one ioloop run are queued and submitted with
+   a single io_uring_enter(), and recvs use kernel-selected buffers from
+   a pool of provided buffers, so idle connections don't need their own
+   read buffers. Completions are signalled via an eventfd to the ioloop,
+   so the timers, ramps, signals and reporting work the same as with the
+   default engine. The ring is set up with raw system calls, so only the
+   kernel headers are needed (Linux 5.7 or later at runtime).
+
+   IMAP scenarios use CAPABILITY, SELECT[:<mailbox>], FETCH[:<messages>
+   [:<items>]], SEARCH[:<criteria>] (sent as UID SEARCH), STORE[:<messages>
+   [:[+|-]<flags>]], EXPUNGE, IDLE[:<secs>] and NOOP. Commas in the
+   parameters are sent as spaces, e.g. FETCH:all:FLAGS,BODY.PEEK[HEADER]
+   and SEARCH:UNSEEN,SINCE,1-Jan-2020. The selected messages are sent as a
+   single sequence set, so FETCH:0.1 sends one FETCH with about 10% of the
+   messages. The defaults are INBOX, BODY.PEEK[], ALL, +\Seen and 10
+   seconds. LOGIN (and STARTTLS) and LOGOUT are added automatically.
+   Replies are matched to the commands by their tags, and FETCH literals
+   are skipped without parsing them the same way as RETR bodies, so they
+   show up in the "retr" throughput figures. The default IMAP scenario is
+   "SELECT FETCH:<retr-probability> STORE:<dele-probability>:\Deleted
+   EXPUNGE".
 */
 
 #include "lib.h"
-#include "network.h"
+#include "array.h"
+#include "llist.h"
+#include "str.h"
+#include "hex-binary.h"
+#include "sha2.h"
+#include "ioloop.h"
+#include "lib-signals.h"
+#include "net.h"
 #include "istream.h"
 #include "ostream.h"
+#include "iostream-ssl.h"
+/* internal header, but we need the SSL pointer for session resumption */
+#include "iostream-openssl.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <dirent.h>
+
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    define POP3TEST_IO_URING
+#  endif
+#endif
+#ifdef POP3TEST_IO_URING
+#  include <sys/syscall.h>
+#  include <sys/socket.h>
+#  include <sys/eventfd.h>
+#  include <netinet/in.h>
+#  include <linux/io_uring.h>
+#endif
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 110
+#define DEFAULT_SSL_PORT 995
+#define DEFAULT_IMAP_PORT 143
+#define DEFAULT_IMAPS_PORT 993
+#define DEFAULT_IDLE_SECS 10
+#define DEFAULT_DRAIN_TIMEOUT_SECS 30
+/* how often closed loop ramp-up starts more sessions */
+#define RAMP_INTERVAL_MSECS 10
+
+#ifndef POP3TEST_REVISION
+#  define POP3TEST_REVISION "unknown"
+#endif
 
-#define IP "127.0.0.1"
-#define PORT 110
-#define PASSWORD "test"
-#define CLIENTS_COUNT 25
+/* io_uring engine: submission and completion queue sizes (the kernel
+   clamps the latter to its maximum), and the provided recv buffers */
+#define URING_SQ_ENTRIES 4096
+#define URING_CQ_ENTRIES 65536
+#define URING_BUF_GROUP 1
+#define URING_BUF_COUNT 4096
+#define URING_BUF_SIZE 1024
+#define URING_LINE_MAX 512
+
+#define MANIFEST_HEADER "pop3test-manifest 1"
+#define DEFAULT_SERVE_MESSAGES 10
+#define DEFAULT_SERVE_MESSAGE_SIZE 10240
+/* stop reading a mock server connection's commands while it has this much
+   output buffered */
+#define SERVE_OUTPUT_MAX_BUFFERED 65536
+#define DEFAULT_PASSWORD "test"
+#define DEFAULT_CLIENTS_COUNT 25
 
 /* u0001@d0001.domain.org .. u0099@d0099.domain.org */
-#define USERNAME_TEMPLATE "u%04lu@d%04lu.domain.org"
-#define USER_RAND 99
-#define DOMAIN_RAND 99
+#define DEFAULT_USERNAME_TEMPLATE "u%04u@d%04u.domain.org"
+#define DEFAULT_USER_RANGE "1-99"
+#define DEFAULT_DOMAIN_RANGE "1-99"
+
+enum client_protocol {
+	CLIENT_PROTOCOL_POP3,
+	CLIENT_PROTOCOL_IMAP
+};
+
+enum client_engine {
+	CLIENT_ENGINE_IOLOOP,
+	CLIENT_ENGINE_IO_URING
+};
+
+enum client_cmd {
+	POP3_CMD_BANNER,
+	POP3_CMD_STLS,
+	POP3_CMD_USER,
+	POP3_CMD_PASS,
+	POP3_CMD_CAPA,
+	POP3_CMD_STAT,
+	POP3_CMD_LIST,
+	POP3_CMD_UIDL,
+	POP3_CMD_TOP,
+	POP3_CMD_RETR,
+	POP3_CMD_DELE,
+	POP3_CMD_NOOP,
+	POP3_CMD_RSET,
+	POP3_CMD_QUIT,
+	/* unknown commands in replayed rawlogs */
+	POP3_CMD_OTHER,
+
+	IMAP_CMD_BANNER,
+	IMAP_CMD_STARTTLS,
+	IMAP_CMD_LOGIN,
+	IMAP_CMD_CAPABILITY,
+	IMAP_CMD_SELECT,
+	IMAP_CMD_FETCH,
+	IMAP_CMD_SEARCH,
+	IMAP_CMD_STORE,
+	IMAP_CMD_EXPUNGE,
+	IMAP_CMD_IDLE,
+	IMAP_CMD_NOOP,
+	IMAP_CMD_LOGOUT,
+
+	CLIENT_CMD_COUNT
+};
+
+enum client_command_flags {
+	/* POP3 +OK is followed by a "." terminated body */
+	COMMAND_FLAG_MULTILINE		= 0x01,
+	/* needs messages selected for it (POP3: one command per message,
+	   IMAP: one command with a sequence set) */
+	COMMAND_FLAG_PER_MESSAGE	= 0x02,
+	/* the session can't continue if this fails */
+	COMMAND_FLAG_REQUIRED		= 0x04,
+	/* tells how many messages there are */
+	COMMAND_FLAG_COUNTS_MESSAGES	= 0x08,
+	/* counted in the retr throughput */
+	COMMAND_FLAG_DOWNLOAD		= 0x10,
+	/* added automatically, can't be used in scenarios */
+	COMMAND_FLAG_IMPLICIT		= 0x20
+};
+
+struct client_command {
+	enum client_protocol protocol;
+	/* NULL for the banner, which is a reply without a command */
+	const char *name;
+	/* name in the report */
+	const char *stat_name;
+	enum client_command_flags flags;
+};
+
+static const struct client_command client_commands[CLIENT_CMD_COUNT] = {
+	{ CLIENT_PROTOCOL_POP3, NULL, "banner",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_POP3, "STLS", "stls",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_POP3, "USER", "user",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_POP3, "PASS", "pass",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_POP3, "CAPA", "capa", COMMAND_FLAG_MULTILINE },
+	{ CLIENT_PROTOCOL_POP3, "STAT", "stat",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_COUNTS_MESSAGES },
+	{ CLIENT_PROTOCOL_POP3, "LIST", "list", COMMAND_FLAG_MULTILINE |
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_COUNTS_MESSAGES },
+	{ CLIENT_PROTOCOL_POP3, "UIDL", "uidl", COMMAND_FLAG_MULTILINE |
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_COUNTS_MESSAGES },
+	{ CLIENT_PROTOCOL_POP3, "TOP", "top",
+	  COMMAND_FLAG_MULTILINE | COMMAND_FLAG_PER_MESSAGE },
+	{ CLIENT_PROTOCOL_POP3, "RETR", "retr", COMMAND_FLAG_MULTILINE |
+	  COMMAND_FLAG_PER_MESSAGE | COMMAND_FLAG_DOWNLOAD },
+	{ CLIENT_PROTOCOL_POP3, "DELE", "dele",
+	  COMMAND_FLAG_PER_MESSAGE | COMMAND_FLAG_REQUIRED },
+	{ CLIENT_PROTOCOL_POP3, "NOOP", "noop", 0 },
+	{ CLIENT_PROTOCOL_POP3, "RSET", "rset", 0 },
+	{ CLIENT_PROTOCOL_POP3, "QUIT", "quit", COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_POP3, NULL, "other", COMMAND_FLAG_IMPLICIT },
+
+	{ CLIENT_PROTOCOL_IMAP, NULL, "banner",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_IMAP, "STARTTLS", "starttls",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_IMAP, "LOGIN", "login",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_IMPLICIT },
+	{ CLIENT_PROTOCOL_IMAP, "CAPABILITY", "capability", 0 },
+	{ CLIENT_PROTOCOL_IMAP, "SELECT", "select",
+	  COMMAND_FLAG_REQUIRED | COMMAND_FLAG_COUNTS_MESSAGES },
+	{ CLIENT_PROTOCOL_IMAP, "FETCH", "fetch",
+	  COMMAND_FLAG_PER_MESSAGE | COMMAND_FLAG_DOWNLOAD },
+	{ CLIENT_PROTOCOL_IMAP, "SEARCH", "uid_search", 0 },
+	{ CLIENT_PROTOCOL_IMAP, "STORE", "store", COMMAND_FLAG_PER_MESSAGE },
+	{ CLIENT_PROTOCOL_IMAP, "EXPUNGE", "expunge", 0 },
+	{ CLIENT_PROTOCOL_IMAP, "IDLE", "idle", 0 },
+	{ CLIENT_PROTOCOL_IMAP, "NOOP", "noop", 0 },
+	{ CLIENT_PROTOCOL_IMAP, "LOGOUT", "logout", COMMAND_FLAG_IMPLICIT }
+};
+
+#define COMMAND_HAS_FLAG(cmd, flag) \
+	((client_commands[cmd].flags & (flag)) != 0)
+
+#define MAX_SCENARIOS 16
+
+enum step_select {
+	STEP_SELECT_ALL,
+	STEP_SELECT_FIRST,
+	STEP_SELECT_LAST,
+	STEP_SELECT_RANDOM
+};
+
+struct scenario_step {
+	enum client_cmd cmd;
+	/* messages to send a per_message command for */
+	enum step_select select;
+	double probability;
+	/* TOP's line count */
+	unsigned int top_lines;
+	unsigned int idle_secs;
+	/* SELECT's mailbox, FETCH items, STORE flags or SEARCH criteria */
+	char *arg;
+
+	/* rawlog replay: the command as captured (pointing to the mmap()ed
+	   file), and how long after the previous command it was sent */
+	const char *raw_line;
+	unsigned int raw_line_len;
+	uint64_t delay_usecs;
+	/* LIST or UIDL with a message number has a single line reply */
+	bool single_line;
+};
+
+struct scenario {
+	char *name;
+	unsigned int weight;
+
+	/* begins with banner and login, ends with QUIT/LOGOUT */
+	struct scenario_step *steps;
+	unsigned int steps_count;
+
+	/* rawlog replay: the captured session's user, or NULL */
+	char *username;
+};
+
+struct rawlog_file {
+	char *path;
+	void *map;
+	size_t size;
+};
+
+enum run_phase {
+	RUN_PHASE_RAMP_UP,
+	RUN_PHASE_STEADY,
+	RUN_PHASE_RAMP_DOWN,
+
+	RUN_PHASE_COUNT
+};
+static const char *run_phase_names[RUN_PHASE_COUNT] = {
+	"ramp-up", "steady", "ramp-down"
+};
+
+enum client_error {
+	CLIENT_ERROR_CONNECT,
+	CLIENT_ERROR_TLS,
+	/* a required command failed */
+	CLIENT_ERROR_COMMAND,
+	CLIENT_ERROR_DISCONNECT,
+	/* unexpected or too long reply */
+	CLIENT_ERROR_PROTOCOL,
+
+	CLIENT_ERROR_COUNT
+};
+static const char *client_error_names[CLIENT_ERROR_COUNT] = {
+	"connect", "tls", "command", "disconnect", "protocol"
+};
+
+/* Log-linear latency histogram (in microseconds). Each power of two is
+   split into HISTOGRAM_SUB_COUNT linear buckets, so the recorded values are
+   accurate to ~3% over the whole range without any configuration. */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKET_COUNT \
+	((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+	uint64_t count, sum, min, max;
+	uint64_t buckets[HISTOGRAM_BUCKET_COUNT];
+};
+
+struct stats {
+	/* time from sending a command (or receiving the previous pipelined
+	   reply) until its full reply was received */
+	struct histogram latency[CLIENT_CMD_COUNT];
+	/* -ERR (or IMAP NO/BAD) replies */
+	uint64_t command_errors[CLIENT_CMD_COUNT];
+	/* from the session's intended start time until QUIT/LOGOUT */
+	struct histogram session_latency;
+	/* time to finish a per-message step, i.e. all of its commands */
+	struct histogram step_latency[CLIENT_CMD_COUNT];
+	/* session latencies split by scenario */
+	struct histogram scenario_latency[MAX_SCENARIOS];
+	/* TLS handshakes, [0] = full, [1] = resumed */
+	struct histogram handshake_latency[2];
+	uint64_t sessions, errors;
+	uint64_t error_types[CLIENT_ERROR_COUNT];
+	/* open loop arrivals skipped because of --max-sessions */
+	uint64_t dropped;
+	uint64_t connections;
+	/* current number of sessions, not a counter */
+	uint64_t active_sessions;
+	/* when the phase started and ended, 0 if not yet */
+	uint64_t phase_start_usecs, phase_end_usecs;
+
+	/* RETR bodies, including the terminating "." line, or FETCH
+	   literals */
+	uint64_t retr_messages, retr_bytes;
+	/* each session's RETR throughput in kB/s */
+	struct histogram session_retr_kbps;
+};
+
+enum ssl_mode {
+	SSL_MODE_NONE,
+	SSL_MODE_IMMEDIATE,
+	SSL_MODE_STARTTLS
+};
+
+struct user_range {
+	unsigned int first, count;
+};
 
-enum client_state {
-	STATE_BANNER,
-	STATE_USER,
-	STATE_PASS,
-	STATE_STAT,
-	STATE_RETR,
-	STATE_RETR_DATA,
-	STATE_DELE,
-	STATE_QUIT
+/* points to the mmap()ed users file */
+struct user {
+	const char *username, *password;
+	unsigned int username_len, password_len;
+};
+
+/* splitmix64, small and good enough for workload generation */
+struct rng {
+	uint64_t state;
 };
 
 struct client {
-	unsigned int cur, messages, deleted;
+	/* all of the session's random choices */
+	struct rng rng;
+	const struct scenario *scenario;
+	/* scenario_latency index */
+	unsigned int scenario_idx;
+	unsigned int step_idx;
+	/* the current step's commands, and the message numbers for
+	   per_message commands */
+	unsigned int cmds_count, cmds_sent, replies_received;
+	ARRAY_TYPE(uint) msgnums;
+	/* from STAT, LIST, UIDL or IMAP EXISTS/EXPUNGE */
+	unsigned int messages;
+	uint64_t step_start_usecs;
+	/* rawlog replay: waiting for the captured delay before sending */
+	struct timeout *to_delay;
+	uint64_t last_send_usecs;
+
+	unsigned int host_idx;
+	int fd;
 	struct istream *input;
 	struct ostream *output;
 	struct io *io;
-	enum client_state state;
+	struct ssl_iostream *ssl_iostream;
+
+	/* reading a multiline reply's body */
+	bool in_body;
+	/* the next body byte in input begins a new line */
+	bool body_line_start;
+	unsigned int body_lines;
+	uint64_t retr_bytes, retr_usecs;
+
+	/* IMAP: tag of the current step's first command, and the next tag */
+	unsigned int tag_base, next_tag;
+	/* bytes left in the literal being skipped */
+	uoff_t literal_left;
+	/* the next line continues an untagged reply after a literal */
+	bool literal_continues;
+	struct timeout *to_idle;
+
+	/* monotonic timestamp of when we started waiting for the current
+	   reply */
+	uint64_t reply_start_usecs;
+	/* when the session was scheduled to start */
+	uint64_t intended_start_usecs;
+	uint64_t handshake_start_usecs;
+	char *username;
+	const char *password;
+	unsigned int password_len;
+};
+
+#ifdef POP3TEST_IO_URING
+enum uring_op {
+	URING_OP_CONNECT,
+	URING_OP_SEND,
+	URING_OP_RECV
+};
+
+/* --engine io_uring session, only the login and QUIT */
+struct uring_client {
+	struct uring_client *prev, *next;
+	struct rng rng;
+	int fd;
+	/* the operation in flight, there's only ever one */
+	enum uring_op op;
+	/* command whose reply we're waiting for */
+	enum client_cmd cmd;
+	uint64_t reply_start_usecs, intended_start_usecs;
 	char *username;
+	const char *password;
+	unsigned int password_len;
+	bool quit_replied;
+
+	/* the reply line received so far */
+	char line[URING_LINE_MAX];
+	unsigned int line_len;
+	/* command being sent, valid until the send has completed */
+	char *send_buf;
+	unsigned int send_len, send_offset;
+};
+
+struct uring {
+	int fd, eventfd;
+	struct io *io;
+
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size, sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_array;
+	unsigned int sq_mask, sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* SQEs not yet passed to the kernel, submitted together at the end
+	   of the ioloop run */
+	unsigned int queued;
+	struct timeout *to_submit;
+	/* CQEs moved out of the full completion queue to make room, not
+	   handled yet */
+	ARRAY(struct io_uring_cqe) reaped;
+
+	struct uring_client *clients;
+	/* clients whose recv failed with ENOBUFS, re-armed after the
+	   completions have given the buffers back */
+	ARRAY(struct uring_client *) buf_waiters;
+
+	/* URING_BUF_COUNT provided buffers for recv */
+	unsigned char *bufs;
+	/* connect() addresses for the hosts */
+	struct sockaddr_storage *addrs;
+	socklen_t *addr_lens;
 };
+#endif
+
+static struct ip_addr *hosts;
+static unsigned int hosts_count, next_host_idx;
+static unsigned int port = 0;
+static unsigned int total_clients_count = DEFAULT_CLIENTS_COUNT;
+static unsigned int duration_secs = 0;
+static unsigned int ramp_up_secs = 0, ramp_down_secs = 0;
+static unsigned int drain_timeout_secs = DEFAULT_DRAIN_TIMEOUT_SECS;
+static const char *username_template = DEFAULT_USERNAME_TEMPLATE;
+static struct user_range user_range, domain_range;
+static const char *password = DEFAULT_PASSWORD;
+static double retr_probability = 1.0;
+static double dele_probability = 0.5;
+static enum client_protocol protocol = CLIENT_PROTOCOL_POP3;
+static enum client_engine engine = CLIENT_ENGINE_IOLOOP;
+#ifdef POP3TEST_IO_URING
+static struct uring uring;
+#endif
+
+static unsigned int pipeline_depth = 0;
+
+/* --rawlog sessions, replayed instead of the scenarios */
+static ARRAY(struct rawlog_file) rawlog_files;
+static struct scenario *rawlog_sessions;
+static unsigned int rawlog_sessions_count, rawlog_next_idx;
+static double rawlog_scale = 1.0;
 
-static int clients_count = 0;
+static struct scenario scenarios[MAX_SCENARIOS];
+static unsigned int scenarios_count, scenarios_total_weight;
+
+static enum ssl_mode ssl_mode = SSL_MODE_NONE;
+static bool ssl_tickets = TRUE, ssl_resume = FALSE;
+static struct ssl_iostream_context *ssl_ctx;
+/* last session received from each host, for --ssl-resume */
+static SSL_SESSION **ssl_sessions;
+
+static void *users_map;
+static size_t users_map_size;
+static struct user *users;
+static unsigned int users_count;
+
+static unsigned int clients_count = 0;
 static struct ioloop *ioloop;
 
+/* open loop mode: total sessions/s across all workers */
+static double arrival_rate = 0;
+static bool arrival_poisson = TRUE;
+static unsigned int max_sessions = 10000;
+static double worker_arrival_rate;
+static double next_arrival_usecs;
+static struct timeout *to_arrival;
+
+/* worker's phase and its closed loop session count at full load */
+static unsigned int current_worker_idx;
+static enum run_phase run_phase;
+static uint64_t run_phase_start_usecs;
+static unsigned int worker_clients_count;
+/* no more new sessions, stop once the running ones have finished */
+static bool draining = FALSE;
+static struct timeout *to_phase, *to_ramp;
+
+/* Shared memory, one struct stats per worker and phase. Each slot is
+   written only by its own worker, so no locking is needed. The parent's
+   merged view may be slightly inconsistent while the workers are
+   running, but it's exact after they have exited. */
+static struct stats *worker_stats;
+static unsigned int workers_count = 1;
+static pid_t *worker_pids;
+static unsigned int workers_alive;
+/* this process's worker_stats slot for the current phase */
+static struct stats *stats;
+static struct stats stats_total;
+static uint64_t run_start_usecs;
+
+/* progress line every n seconds, printed by the reporting process */
+static unsigned int progress_secs = 1;
+static struct timeout *to_progress;
+static struct stats *progress_prev_stats;
+static uint64_t progress_prev_usecs;
+
+static uint64_t seed;
+static bool seed_set = FALSE;
+/* worker's generators for session seeds and arrival times */
+static struct rng session_rng, arrival_rng;
+static const char *manifest_path;
+/* "<size>\t<sha256>\t<path>" of the input files in the replayed manifest */
+static char **replay_files;
+static unsigned int replay_files_count;
+
+/* --serve mock server processes */
+static unsigned int serve_count = 0;
+static unsigned int serve_messages = DEFAULT_SERVE_MESSAGES;
+static unsigned int serve_message_size = DEFAULT_SERVE_MESSAGE_SIZE;
+static int serve_fd = -1;
+static pid_t *serve_pids;
+/* prebuilt replies */
+static string_t *serve_retr, *serve_top, *serve_list, *serve_uidl;
+static char *serve_stat;
+static size_t serve_retr_size;
+
+struct serve_conn {
+	int fd;
+	struct io *io;
+	struct istream *input;
+	struct ostream *output;
+	bool quit;
+};
+
+struct metrics_client {
+	struct metrics_client *prev, *next;
+
+	int fd;
+	struct io *io;
+	struct istream *input;
+	struct ostream *output;
+};
+
+/* --metrics listener, served by the reporting process */
+static const char *metrics_path;
+static int metrics_fd = -1;
+static bool metrics_http;
+static struct io *io_metrics;
+static struct metrics_client *metrics_clients;
+
+struct client *client_new(uint64_t intended_start_usecs);
 void client_free(struct client *client);
+static void client_replace(void);
+static void client_input(struct client *client);
 
-static void client_input(void *context)
+static void rng_init(struct rng *rng, uint64_t rng_seed)
 {
-	struct client *client = context;
-	const char *line, *str;
+	rng->state = rng_seed;
+}
+
+static uint64_t rng_next(struct rng *rng)
+{
+	uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Returns a random number in [0, 1) */
+static double rng_double(struct rng *rng)
+{
+	return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Returns TRUE with the given probability */
+static bool rand_chance(struct rng *rng, double probability)
+{
+	if (probability >= 1.0)
+		return TRUE;
+	return rng_double(rng) < probability;
+}
+
+static uint64_t clock_usecs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		i_fatal("clock_gettime(CLOCK_MONOTONIC) failed: %m");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int histogram_bucket_idx(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HISTOGRAM_SUB_COUNT)
+		return value;
+	shift = (63 - __builtin_clzll(value)) - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+		((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+static uint64_t histogram_bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HISTOGRAM_SUB_COUNT)
+		return idx;
+	shift = (idx >> HISTOGRAM_SUB_BITS) - 1;
+	return (((uint64_t)(idx % HISTOGRAM_SUB_COUNT) +
+		 HISTOGRAM_SUB_COUNT) << shift) + ((1ULL << shift) - 1);
+}
+
+static void histogram_add(struct histogram *hist, uint64_t value)
+{
+	if (hist->count == 0 || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[histogram_bucket_idx(value)]++;
+}
+
+static uint64_t histogram_percentile(const struct histogram *hist,
+				     double percentile)
+{
+	uint64_t rank, total = 0;
 	unsigned int i;
 
-	switch (i_stream_read(client->input)) {
-	case 0:
-		return;
-	case -1:
-		/* disconnected */
-		client_free(client);
-		return;
-	case -2:
-		/* buffer full */
-		i_error("line too long");
-		client_free(client);
-		return;
+	if (hist->count == 0)
+		return 0;
+	rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+		total += hist->buckets[i];
+		if (total >= rank)
+			return I_MIN(histogram_bucket_max(i), hist->max);
 	}
+	return hist->max;
+}
 
-	while ((line = i_stream_next_line(client->input)) != NULL) {
-		switch (client->state) {
-		case STATE_BANNER:
-			str = t_strdup_printf("USER %s\r\n", client->username);
-			o_stream_send_str(client->output, str);
-			client->state = STATE_USER;
-			break;
-		case STATE_USER:
-			if (*line != '+') {
-				i_error("USER failed: %s", line);
-				client_free(client);
-				return;
-			}
-			str = t_strdup_printf("PASS %s\r\n", PASSWORD);
-			o_stream_send_str(client->output, str);
-			client->state = STATE_PASS;
-			break;
-		case STATE_PASS:
-			if (*line != '+') {
-				i_error("Login failed: %s", line);
-				client_free(client);
-				return;
-			}
-			o_stream_send_str(client->output, "STAT\r\n");
-			client->state = STATE_STAT;
-			break;
-		case STATE_STAT:
-			if (*line != '+') {
-				i_error("STAT failed: %s", line);
-				client_free(client);
-				return;
-			}
-			sscanf(line, "+OK %u", &client->messages);
-			i_info("%s: %u messages", client->username,
-			       client->messages);
-			if (client->messages == 0) {
-				client_free(client);
-				return;
-			}
+static void histogram_print_row(const char *name,
+				const struct histogram *hist)
+{
+	printf("%-10s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+	       name,
+	       (unsigned long long)hist->count,
+	       (unsigned long long)hist->min,
+	       (unsigned long long)histogram_percentile(hist, 50),
+	       (unsigned long long)histogram_percentile(hist, 90),
+	       (unsigned long long)histogram_percentile(hist, 99),
+	       (unsigned long long)histogram_percentile(hist, 99.9),
+	       (unsigned long long)hist->max);
+}
 
-			for (i = 1; i <= client->messages; i++) {
-				t_push();
-				str = t_strdup_printf("RETR %u\r\n", i);
-				o_stream_send_str(client->output, str);
-				t_pop();
-			}
-			client->state = STATE_RETR;
-			break;
-		case STATE_RETR:
-			client->cur++;
-			if (*line != '+') {
-				/*i_error("RETR %u failed: %s",
-					client->cur, line);*/
-				if (client->cur == client->messages)
-					goto __kludge;
-				break;
-			}
-			client->state = STATE_RETR_DATA;
-			break;
-		case STATE_RETR_DATA:
-			if (strcmp(line, ".") != 0)
-				break;
+static void histogram_print_summary(const char *name,
+				    const struct histogram *hist)
+{
+	printf("summary\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+	       name,
+	       (unsigned long long)hist->count,
+	       (unsigned long long)hist->min,
+	       (unsigned long long)histogram_percentile(hist, 50),
+	       (unsigned long long)histogram_percentile(hist, 90),
+	       (unsigned long long)histogram_percentile(hist, 99),
+	       (unsigned long long)histogram_percentile(hist, 99.9),
+	       (unsigned long long)hist->max,
+	       (unsigned long long)(hist->count == 0 ? 0 :
+				    hist->sum / hist->count));
+}
 
-			if (client->cur != client->messages) {
-				client->state = STATE_RETR;
-				break;
-			}
+static void stats_print(const struct stats *st)
+{
+	double secs = (st->phase_end_usecs - st->phase_start_usecs) / 1000000.0;
+	unsigned int i;
 
-		__kludge:
-			/* all fetched, delete them randomly */
-			for (i = 1; i <= client->messages; i++) {
-				if ((random() % 2) == 0) {
-					t_push();
-					str = t_strdup_printf("DELE %u\r\n", i);
-					o_stream_send_str(client->output, str);
-					t_pop();
-					client->deleted++;
-				}
-			}
-			client->state = STATE_DELE;
-			if (client->deleted == 0)
-				goto __kludge2;
-			break;
-		case STATE_DELE:
-			if (*line != '+') {
-				i_error("DELE failed: %s", line);
-				client_free(client);
-				return;
-			}
-			client->deleted--;
-			if (client->deleted != 0)
-				break;
+	if (secs <= 0)
+		secs = 1;
+	printf("\n%-10s %10s %10s %10s %10s %10s %10s %10s (usecs)\n",
+	       "command", "count", "min", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (client_commands[i].protocol == protocol) {
+			histogram_print_row(client_commands[i].stat_name,
+					    &st->latency[i]);
+		}
+	}
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) T_BEGIN {
+		if (client_commands[i].protocol == protocol &&
+		    COMMAND_HAS_FLAG(i, COMMAND_FLAG_PER_MESSAGE)) {
+			histogram_print_row(t_strconcat(
+					client_commands[i].stat_name,
+					"_step", NULL), &st->step_latency[i]);
+		}
+	} T_END;
+	histogram_print_row("session", &st->session_latency);
+	for (i = 0; i < scenarios_count; i++) T_BEGIN {
+		histogram_print_row(t_strconcat("s:", scenarios[i].name, NULL),
+				    &st->scenario_latency[i]);
+	} T_END;
+	histogram_print_row("tls_full", &st->handshake_latency[0]);
+	histogram_print_row("tls_resumed", &st->handshake_latency[1]);
+	printf("sessions: %llu, errors: %llu, dropped: %llu\n",
+	       (unsigned long long)st->sessions,
+	       (unsigned long long)st->errors,
+	       (unsigned long long)st->dropped);
+	for (i = 0; i < CLIENT_ERROR_COUNT; i++) {
+		if (st->error_types[i] != 0) {
+			printf("%s errors: %llu\n", client_error_names[i],
+			       (unsigned long long)st->error_types[i]);
+		}
+	}
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (st->command_errors[i] != 0) {
+			printf("%s failures: %llu\n",
+			       client_commands[i].stat_name,
+			       (unsigned long long)st->command_errors[i]);
+		}
+	}
+	printf("retr: %llu messages, %llu bytes, %.1f messages/s, %.3f MB/s\n",
+	       (unsigned long long)st->retr_messages,
+	       (unsigned long long)st->retr_bytes,
+	       st->retr_messages / secs, st->retr_bytes / secs / 1000000);
+	printf("\n%-10s %10s %10s %10s %10s %10s %10s %10s (kB/s)\n",
+	       "throughput", "count", "min", "p50", "p90", "p99", "p99.9",
+	       "max");
+	histogram_print_row("session", &st->session_retr_kbps);
 
-		__kludge2:
-			/* processed all DELE commands. */
-			o_stream_send_str(client->output, "QUIT\r\n");
-			client->state = STATE_QUIT;
-			break;
-		case STATE_QUIT:
-			break;
+	/* machine-readable summary, tab-separated */
+	printf("\nsummary\tcommand\tcount\tmin\tp50\tp90\tp99\tp99.9\t"
+	       "max\tmean\n");
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (client_commands[i].protocol == protocol) {
+			histogram_print_summary(client_commands[i].stat_name,
+						&st->latency[i]);
 		}
 	}
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) T_BEGIN {
+		if (client_commands[i].protocol == protocol &&
+		    COMMAND_HAS_FLAG(i, COMMAND_FLAG_PER_MESSAGE)) {
+			histogram_print_summary(
+				t_strconcat(client_commands[i].stat_name,
+					    "_step", NULL),
+				&st->step_latency[i]);
+		}
+	} T_END;
+	histogram_print_summary("session", &st->session_latency);
+	for (i = 0; i < scenarios_count; i++) T_BEGIN {
+		histogram_print_summary(t_strconcat("scenario_",
+						    scenarios[i].name, NULL),
+					&st->scenario_latency[i]);
+	} T_END;
+	histogram_print_summary("tls_full", &st->handshake_latency[0]);
+	histogram_print_summary("tls_resumed", &st->handshake_latency[1]);
+	printf("summary\tseed\t%llu\n", (unsigned long long)seed);
+	printf("summary\tsessions\t%llu\nsummary\terrors\t%llu\n"
+	       "summary\tdropped\t%llu\n",
+	       (unsigned long long)st->sessions,
+	       (unsigned long long)st->errors,
+	       (unsigned long long)st->dropped);
+	for (i = 0; i < CLIENT_ERROR_COUNT; i++) {
+		printf("summary\terrors_%s\t%llu\n", client_error_names[i],
+		       (unsigned long long)st->error_types[i]);
+	}
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (client_commands[i].protocol != protocol)
+			continue;
+		printf("summary\terrors_%s\t%llu\n",
+		       client_commands[i].stat_name,
+		       (unsigned long long)st->command_errors[i]);
+	}
+	histogram_print_summary("retr_kbps", &st->session_retr_kbps);
+	printf("summary\tretr_messages\t%llu\nsummary\tretr_bytes\t%llu\n"
+	       "summary\tretr_messages_per_sec\t%.1f\n"
+	       "summary\tretr_bytes_per_sec\t%.0f\n",
+	       (unsigned long long)st->retr_messages,
+	       (unsigned long long)st->retr_bytes,
+	       st->retr_messages / secs, st->retr_bytes / secs);
+	fflush(stdout);
 }
 
-struct client *client_new(void)
+static void histogram_merge(struct histogram *dest,
+			    const struct histogram *src)
 {
-	struct client *client;
-	struct ip_addr ip;
-	int fd;
+	unsigned int i;
 
-	net_addr2ip(IP, &ip);
-	fd = net_connect_ip(&ip, PORT, NULL);
-	if (fd < 0) {
-		i_error("connect() failed: %m");
-		return NULL;
+	if (src->count == 0)
+		return;
+	if (dest->count == 0 || src->min < dest->min)
+		dest->min = src->min;
+	if (src->max > dest->max)
+		dest->max = src->max;
+	dest->count += src->count;
+	dest->sum += src->sum;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+		dest->buckets[i] += src->buckets[i];
+}
+
+static void stats_merge(struct stats *dest, const struct stats *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		histogram_merge(&dest->latency[i], &src->latency[i]);
+		histogram_merge(&dest->step_latency[i], &src->step_latency[i]);
+		dest->command_errors[i] += src->command_errors[i];
 	}
+	histogram_merge(&dest->session_latency, &src->session_latency);
+	for (i = 0; i < MAX_SCENARIOS; i++) {
+		histogram_merge(&dest->scenario_latency[i],
+				&src->scenario_latency[i]);
+	}
+	for (i = 0; i < N_ELEMENTS(dest->handshake_latency); i++) {
+		histogram_merge(&dest->handshake_latency[i],
+				&src->handshake_latency[i]);
+	}
+	if (src->phase_start_usecs != 0) {
+		/* a phase that is still running ends now */
+		uint64_t end = src->phase_end_usecs != 0 ?
+			src->phase_end_usecs : clock_usecs();
 
-	client = i_new(struct client, 1);
-	client->input = i_stream_create_file(fd, default_pool, 65536, TRUE);
-	client->output = o_stream_create_file(fd, default_pool, (size_t)-1, FALSE);
-	client->io = io_add(fd, IO_READ, client_input, client);
-	client->username = i_strdup_printf(USERNAME_TEMPLATE,
-					   (random() % USER_RAND) + 1,
-					   (random() % DOMAIN_RAND) + 1);
-	clients_count++;
-	return client;
+		if (dest->phase_start_usecs == 0 ||
+		    src->phase_start_usecs < dest->phase_start_usecs)
+			dest->phase_start_usecs = src->phase_start_usecs;
+		if (end > dest->phase_end_usecs)
+			dest->phase_end_usecs = end;
+	}
+	dest->sessions += src->sessions;
+	for (i = 0; i < CLIENT_ERROR_COUNT; i++)
+		dest->error_types[i] += src->error_types[i];
+	dest->connections += src->connections;
+	dest->active_sessions += src->active_sessions;
+	dest->errors += src->errors;
+	dest->dropped += src->dropped;
+	dest->retr_messages += src->retr_messages;
+	dest->retr_bytes += src->retr_bytes;
+	histogram_merge(&dest->session_retr_kbps, &src->session_retr_kbps);
 }
 
-void client_free(struct client *client)
+static struct stats *
+worker_phase_stats(unsigned int worker_idx, enum run_phase phase)
 {
-	--clients_count;
-	/*if (--clients_count == 0)
-		io_loop_stop(ioloop);*/
-	io_remove(client->io);
-	o_stream_unref(client->output);
-	i_stream_unref(client->input);
-	i_free(client->username);
-	i_free(client);
+	return &worker_stats[worker_idx * RUN_PHASE_COUNT + phase];
+}
+
+static void stats_merge_phase(enum run_phase phase)
+{
+	unsigned int i;
 
-	client_new();
+	memset(&stats_total, 0, sizeof(stats_total));
+	for (i = 0; i < workers_count; i++)
+		stats_merge(&stats_total, worker_phase_stats(i, phase));
 }
 
-int main(void)
+/* Merge all workers and phases */
+static void stats_merge_total(void)
 {
-	int i;
+	unsigned int i;
 
-	lib_init();
-	ioloop = io_loop_create(system_pool);
+	memset(&stats_total, 0, sizeof(stats_total));
+	for (i = 0; i < workers_count * RUN_PHASE_COUNT; i++)
+		stats_merge(&stats_total, &worker_stats[i]);
+}
+
+static void stats_print_total(void)
+{
+	enum run_phase phase;
+
+	if (ramp_up_secs == 0 && ramp_down_secs == 0) {
+		/* everything is in the steady phase */
+		stats_merge_total();
+		stats_print(&stats_total);
+		return;
+	}
+	for (phase = 0; phase < RUN_PHASE_COUNT; phase++) {
+		stats_merge_phase(phase);
+		if (stats_total.phase_start_usecs == 0)
+			continue;
+		printf("\n=== %s ===\n", run_phase_names[phase]);
+		printf("summary\tphase\t%s\n", run_phase_names[phase]);
+		stats_print(&stats_total);
+	}
+}
+
+/* dest = cur - prev, i.e. only the values added since prev */
+static void histogram_diff(struct histogram *dest,
+			   const struct histogram *cur,
+			   const struct histogram *prev)
+{
+	unsigned int i;
 
-	for (i = 0; i < CLIENTS_COUNT; i++)
-		client_new();
-        io_loop_run(ioloop);
+	dest->count = cur->count - prev->count;
+	dest->sum = cur->sum - prev->sum;
+	/* the exact values are lost, use the overall ones as bounds */
+	dest->min = cur->min;
+	dest->max = cur->max;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+		dest->buckets[i] = cur->buckets[i] - prev->buckets[i];
+}
+
+static void progress_timeout(void *context ATTR_UNUSED)
+{
+	static struct histogram interval_latency;
+	const struct stats *prev = progress_prev_stats;
+	uint64_t now = clock_usecs(), command_errors = 0;
+	double secs = (now - progress_prev_usecs) / 1000000.0;
+	enum run_phase phase;
+	unsigned int i;
+
+	stats_merge_total();
+	histogram_diff(&interval_latency, &stats_total.session_latency,
+		       &prev->session_latency);
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		command_errors += stats_total.command_errors[i] -
+			prev->command_errors[i];
+	}
+
+	for (phase = RUN_PHASE_COUNT - 1; phase > 0; phase--) {
+		if (worker_phase_stats(0, phase)->phase_start_usecs != 0)
+			break;
+	}
+	fprintf(stderr, "%5llus %s: conn/s %.1f, active %llu, sessions/s %.1f, "
+		"session usecs p50 %llu p90 %llu p99 %llu, errors",
+		(unsigned long long)(now - run_start_usecs) / 1000000,
+		run_phase_names[phase],
+		(stats_total.connections - prev->connections) / secs,
+		(unsigned long long)stats_total.active_sessions,
+		(stats_total.sessions - prev->sessions) / secs,
+		(unsigned long long)histogram_percentile(&interval_latency,
+							 50),
+		(unsigned long long)histogram_percentile(&interval_latency,
+							 90),
+		(unsigned long long)histogram_percentile(&interval_latency,
+							 99));
+	for (i = 0; i < CLIENT_ERROR_COUNT; i++) {
+		fprintf(stderr, " %s %llu", client_error_names[i],
+			(unsigned long long)(stats_total.error_types[i] -
+					     prev->error_types[i]));
+	}
+	fprintf(stderr, " failed-commands %llu dropped %llu\n",
+		(unsigned long long)command_errors,
+		(unsigned long long)(stats_total.dropped - prev->dropped));
+	*progress_prev_stats = stats_total;
+	progress_prev_usecs = now;
+}
+
+static void metrics_append_histogram(string_t *str, const char *name,
+				     const char *label,
+				     const struct histogram *hist)
+{
+	static const double quantiles[] = { 50, 90, 99, 99.9 };
+	const char *sep = label[0] == '\0' ? "" : ",";
+	unsigned int i;
 
-	io_loop_destroy(ioloop);
+	for (i = 0; i < N_ELEMENTS(quantiles); i++) {
+		unsigned long long value =
+			histogram_percentile(hist, quantiles[i]);
+
+		str_printfa(str, "pop3test_%s{%s%squantile=\"%g\"} %llu\n",
+			    name, label, sep, quantiles[i] / 100, value);
+	}
+	/* "{}" isn't valid without labels */
+	if (label[0] != '\0')
+		label = t_strdup_printf("{%s}", label);
+	str_printfa(str, "pop3test_%s_sum%s %llu\n"
+		    "pop3test_%s_count%s %llu\n",
+		    name, label, (unsigned long long)hist->sum,
+		    name, label, (unsigned long long)hist->count);
+}
+
+/* Prometheus text exposition format */
+static void metrics_append(string_t *str, const struct stats *st)
+{
+	unsigned int i;
+
+	str_printfa(str, "# TYPE pop3test_connections_total counter\n"
+		    "pop3test_connections_total %llu\n"
+		    "# TYPE pop3test_sessions_total counter\n"
+		    "pop3test_sessions_total %llu\n"
+		    "# TYPE pop3test_active_sessions gauge\n"
+		    "pop3test_active_sessions %llu\n"
+		    "# TYPE pop3test_dropped_total counter\n"
+		    "pop3test_dropped_total %llu\n"
+		    "# TYPE pop3test_retr_messages_total counter\n"
+		    "pop3test_retr_messages_total %llu\n"
+		    "# TYPE pop3test_retr_bytes_total counter\n"
+		    "pop3test_retr_bytes_total %llu\n",
+		    (unsigned long long)st->connections,
+		    (unsigned long long)st->sessions,
+		    (unsigned long long)st->active_sessions,
+		    (unsigned long long)st->dropped,
+		    (unsigned long long)st->retr_messages,
+		    (unsigned long long)st->retr_bytes);
+
+	str_append(str, "# TYPE pop3test_errors_total counter\n");
+	for (i = 0; i < CLIENT_ERROR_COUNT; i++) {
+		str_printfa(str, "pop3test_errors_total{type=\"%s\"} %llu\n",
+			    client_error_names[i],
+			    (unsigned long long)st->error_types[i]);
+	}
+	str_append(str, "# TYPE pop3test_command_errors_total counter\n");
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (client_commands[i].protocol != protocol)
+			continue;
+		str_printfa(str, "pop3test_command_errors_total"
+			    "{command=\"%s\"} %llu\n",
+			    client_commands[i].stat_name,
+			    (unsigned long long)st->command_errors[i]);
+	}
+
+	str_append(str, "# TYPE pop3test_command_latency_usecs summary\n");
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (client_commands[i].protocol != protocol)
+			continue;
+		metrics_append_histogram(str, "command_latency_usecs",
+			t_strdup_printf("command=\"%s\"",
+					client_commands[i].stat_name),
+			&st->latency[i]);
+	}
+	str_append(str, "# TYPE pop3test_session_latency_usecs summary\n");
+	metrics_append_histogram(str, "session_latency_usecs", "",
+				 &st->session_latency);
+}
+
+static void metrics_client_destroy(struct metrics_client *mclient)
+{
+	DLLIST_REMOVE(&metrics_clients, mclient);
+	io_remove(&mclient->io);
+	o_stream_destroy(&mclient->output);
+	i_stream_destroy(&mclient->input);
+	net_disconnect(mclient->fd);
+	i_free(mclient);
+}
+
+static int metrics_client_output(struct metrics_client *mclient)
+{
+	int ret;
+
+	if ((ret = o_stream_flush(mclient->output)) != 0) {
+		/* everything sent (or failed), close */
+		metrics_client_destroy(mclient);
+		return 1;
+	}
+	return 0;
+}
+
+/* Queue the metrics to the client's ostream and close the connection once
+   they've been flushed. */
+static void metrics_send(struct metrics_client *mclient)
+{
+	string_t *str = t_str_new(8192);
+
+	stats_merge_total();
+	metrics_append(str, &stats_total);
+	if (metrics_http) {
+		o_stream_nsend_str(mclient->output, t_strdup_printf(
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", str_len(str)));
+	}
+	o_stream_nsend(mclient->output, str_data(str), str_len(str));
+
+	io_remove(&mclient->io);
+	o_stream_set_flush_pending(mclient->output, TRUE);
+}
+
+static void metrics_client_input(struct metrics_client *mclient)
+{
+	const char *line;
+
+	switch (i_stream_read(mclient->input)) {
+	case -1:
+	case -2:
+		/* disconnected or the request line is too long */
+		metrics_client_destroy(mclient);
+		return;
+	}
+
+	/* the request itself doesn't matter, every path returns the same
+	   metrics. read the headers so closing doesn't reset the
+	   connection. */
+	while ((line = i_stream_next_line(mclient->input)) != NULL) {
+		if (*line == '\0' || strcmp(line, "\r") == 0) {
+			T_BEGIN {
+				metrics_send(mclient);
+			} T_END;
+			return;
+		}
+	}
+}
+
+static void metrics_accept(void *context ATTR_UNUSED)
+{
+	struct metrics_client *mclient;
+	int fd;
+
+	fd = net_accept(metrics_fd, NULL, NULL);
+	if (fd < 0) {
+		if (fd == -2)
+			i_error("accept(%s) failed: %m", metrics_path);
+		return;
+	}
+	net_set_nonblock(fd, TRUE);
+
+	mclient = i_new(struct metrics_client, 1);
+	mclient->fd = fd;
+	mclient->input = i_stream_create_fd(fd, 4096);
+	mclient->output = o_stream_create_fd(fd, SIZE_MAX);
+	o_stream_set_no_error_handling(mclient->output, TRUE);
+	o_stream_set_flush_callback(mclient->output, metrics_client_output,
+				    mclient);
+	DLLIST_PREPEND(&metrics_clients, mclient);
+
+	if (!metrics_http) {
+		/* unix socket: just write the metrics and close */
+		T_BEGIN {
+			metrics_send(mclient);
+		} T_END;
+		return;
+	}
+	mclient->io = io_add_istream(mclient->input, metrics_client_input,
+				     mclient);
+}
+
+static void metrics_listen(void)
+{
+	struct ip_addr ip;
+	const char *host;
+	in_port_t metrics_port;
+	unsigned int num;
+
+	if (strchr(metrics_path, '/') != NULL) {
+		/* remove a stale socket from a previous run */
+		if (unlink(metrics_path) < 0 && errno != ENOENT)
+			i_fatal("unlink(%s) failed: %m", metrics_path);
+		metrics_fd = net_listen_unix(metrics_path, 16);
+		if (metrics_fd == -1)
+			i_fatal("net_listen_unix(%s) failed: %m", metrics_path);
+		return;
+	}
+
+	/* [<ip>:]<port>, localhost by default. IPv6 addresses need the
+	   brackets: [<ip>]:<port> */
+	if (str_to_uint(metrics_path, &num) == 0) {
+		if (num == 0 || num > 65535)
+			i_fatal("Invalid --metrics port: %s", metrics_path);
+		metrics_port = num;
+		if (net_addr2ip("127.0.0.1", &ip) < 0)
+			i_unreached();
+	} else {
+		if (net_str2hostport(metrics_path, 0, &host,
+				     &metrics_port) < 0 || metrics_port == 0)
+			i_fatal("Invalid --metrics port: %s", metrics_path);
+		if (net_addr2ip(host, &ip) < 0)
+			i_fatal("Invalid --metrics IP: %s", metrics_path);
+	}
+	metrics_fd = net_listen(&ip, &metrics_port, 16);
+	if (metrics_fd == -1)
+		i_fatal("net_listen(%s) failed: %m", metrics_path);
+	metrics_http = TRUE;
+}
+
+/* Start the progress timer and the metrics listener in the process that
+   sees all the workers' statistics. */
+static void reporting_init(void)
+{
+	if (progress_secs > 0) {
+		progress_prev_stats = i_new(struct stats, 1);
+		progress_prev_usecs = clock_usecs();
+		to_progress = timeout_add(progress_secs * 1000,
+					  progress_timeout, NULL);
+	}
+	if (metrics_fd != -1)
+		io_metrics = io_add(metrics_fd, IO_READ, metrics_accept, NULL);
+}
+
+static void reporting_deinit(void)
+{
+	timeout_remove(&to_progress);
+	i_free(progress_prev_stats);
+	io_remove(&io_metrics);
+	while (metrics_clients != NULL)
+		metrics_client_destroy(metrics_clients);
+}
+
+static const struct scenario_step *client_step(struct client *client)
+{
+	return &client->scenario->steps[client->step_idx];
+}
+
+static void client_session_finished(struct client *client)
+{
+	uint64_t usecs = clock_usecs() - client->intended_start_usecs;
+
+	stats->sessions++;
+	histogram_add(&stats->session_latency, usecs);
+	histogram_add(&stats->scenario_latency[client->scenario_idx],
+		      usecs);
+	if (client->retr_usecs > 0) {
+		/* bytes/usec = MB/s, so *1000 gives kB/s */
+		histogram_add(&stats->session_retr_kbps,
+			      client->retr_bytes * 1000 / client->retr_usecs);
+	}
+}
+
+/* Skip over a multiline reply's body in the input buffer without splitting
+   it into lines. memchr() is vectorized in any reasonable libc, so this is
+   much cheaper than i_stream_next_line(). Returns TRUE once the
+   terminating ".\r\n" line has been skipped. */
+static bool client_body_skip(struct client *client)
+{
+	const unsigned char *data, *p, *end, *nl;
+	bool finished = FALSE;
+	size_t size;
+
+	data = i_stream_get_data(client->input, &size);
+	p = data;
+	end = data + size;
+	while (p < end) {
+		if (client->body_line_start && *p == '.') {
+			/* either the terminator or a dot-stuffed line */
+			if (end - p < 2)
+				break;
+			if (p[1] == '\n') {
+				p += 2;
+				finished = TRUE;
+				break;
+			}
+			if (p[1] == '\r') {
+				if (end - p < 3)
+					break;
+				if (p[2] == '\n') {
+					p += 3;
+					finished = TRUE;
+					break;
+				}
+			}
+		}
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL) {
+			client->body_line_start = FALSE;
+			p = end;
+			break;
+		}
+		p = nl + 1;
+		client->body_line_start = TRUE;
+		client->body_lines++;
+	}
+
+	i_stream_skip(client->input, p - data);
+	if (COMMAND_HAS_FLAG(client_step(client)->cmd, COMMAND_FLAG_DOWNLOAD)) {
+		client->retr_bytes += p - data;
+		stats->retr_bytes += p - data;
+		if (finished)
+			stats->retr_messages++;
+	}
+	return finished;
+}
+
+/* Count size more literal bytes as downloaded, and the message once the
+   whole literal has been read. */
+static void client_literal_count(struct client *client, size_t size)
+{
+	if (COMMAND_HAS_FLAG(client_step(client)->cmd, COMMAND_FLAG_DOWNLOAD)) {
+		client->retr_bytes += size;
+		stats->retr_bytes += size;
+		if (client->literal_left == 0)
+			stats->retr_messages++;
+	}
+}
+
+/* Skip over the IMAP literal being read. Returns TRUE once all of it has
+   been skipped. */
+static bool client_literal_skip(struct client *client)
+{
+	size_t size;
+
+	(void)i_stream_get_data(client->input, &size);
+	if (size > client->literal_left)
+		size = client->literal_left;
+	i_stream_skip(client->input, size);
+	client->literal_left -= size;
+
+	client_literal_count(client, size);
+	return client->literal_left == 0;
+}
+
+static void client_fail(struct client *client, enum client_error error)
+{
+	stats->errors++;
+	stats->error_types[error]++;
+	client_free(client);
+}
+
+static int client_ssl_handshaked(const char **error_r ATTR_UNUSED,
+				 void *context)
+{
+	struct client *client = context;
+	uint64_t now = clock_usecs();
+	bool resumed = SSL_session_reused(client->ssl_iostream->ssl) != 0;
+
+	histogram_add(&stats->handshake_latency[resumed ? 1 : 0],
+		      now - client->handshake_start_usecs);
+	/* don't include the handshake in the next reply's latency */
+	client->reply_start_usecs = now;
+	return 0;
+}
+
+static void client_ssl_save_session(struct client *client)
+{
+	SSL_SESSION *session;
+
+	/* with TLSv1.3 the session ticket arrives after the handshake, so
+	   this is done only when the session is finished */
+	session = SSL_get1_session(client->ssl_iostream->ssl);
+	if (session == NULL)
+		return;
+	if (!SSL_SESSION_is_resumable(session)) {
+		SSL_SESSION_free(session);
+		return;
+	}
+	if (ssl_sessions[client->host_idx] != NULL)
+		SSL_SESSION_free(ssl_sessions[client->host_idx]);
+	ssl_sessions[client->host_idx] = session;
+}
+
+static int client_ssl_init(struct client *client)
+{
+	struct ssl_iostream_settings ssl_set;
+	const char *error;
+
+	memset(&ssl_set, 0, sizeof(ssl_set));
+	ssl_set.allow_invalid_cert = TRUE;
+
+	io_remove(&client->io);
+	if (io_stream_create_ssl_client(ssl_ctx,
+					net_ip2addr(&hosts[client->host_idx]),
+					&ssl_set, &client->input,
+					&client->output,
+					&client->ssl_iostream, &error) < 0) {
+		i_error("Couldn't initialize SSL client: %s", error);
+		return -1;
+	}
+	if (ssl_resume && ssl_sessions[client->host_idx] != NULL) {
+		(void)SSL_set_session(client->ssl_iostream->ssl,
+				      ssl_sessions[client->host_idx]);
+	}
+	ssl_iostream_set_handshake_callback(client->ssl_iostream,
+					    client_ssl_handshaked, client);
+	client->handshake_start_usecs = clock_usecs();
+	if (ssl_iostream_handshake(client->ssl_iostream) < 0) {
+		i_error("SSL handshake failed: %s",
+			ssl_iostream_get_last_error(client->ssl_iostream));
+		return -1;
+	}
+	client->io = io_add_istream(client->input, client_input, client);
+	return 0;
+}
+
+static void client_select_messages(struct client *client,
+				   const struct scenario_step *step)
+{
+	unsigned int msgnum;
+
+	array_clear(&client->msgnums);
+	if (client->messages == 0)
+		return;
+
+	switch (step->select) {
+	case STEP_SELECT_ALL:
+	case STEP_SELECT_RANDOM:
+		for (msgnum = 1; msgnum <= client->messages; msgnum++) {
+			if (step->select == STEP_SELECT_ALL ||
+			    rand_chance(&client->rng, step->probability))
+				array_append(&client->msgnums, &msgnum, 1);
+		}
+		break;
+	case STEP_SELECT_FIRST:
+		msgnum = 1;
+		array_append(&client->msgnums, &msgnum, 1);
+		break;
+	case STEP_SELECT_LAST:
+		array_append(&client->msgnums, &client->messages, 1);
+		break;
+	}
+}
+
+static void client_send_pop3_cmd(struct client *client, unsigned int idx)
+{
+	const struct scenario_step *step = client_step(client);
+	const struct client_command *cmd = &client_commands[step->cmd];
+	unsigned int msgnum = 0;
+	const char *str;
+
+	if (step->raw_line != NULL) {
+		o_stream_nsend(client->output, step->raw_line,
+			       step->raw_line_len);
+		o_stream_nsend(client->output, "\r\n", 2);
+		return;
+	}
+	if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_PER_MESSAGE))
+		msgnum = *array_idx(&client->msgnums, idx);
+
+	switch (step->cmd) {
+	case POP3_CMD_USER:
+		str = t_strdup_printf("USER %s\r\n", client->username);
+		break;
+	case POP3_CMD_PASS:
+		str = t_strdup_printf("PASS %.*s\r\n",
+				      (int)client->password_len,
+				      client->password);
+		break;
+	case POP3_CMD_TOP:
+		str = t_strdup_printf("TOP %u %u\r\n", msgnum,
+				      step->top_lines);
+		break;
+	default:
+		if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_PER_MESSAGE))
+			str = t_strdup_printf("%s %u\r\n", cmd->name, msgnum);
+		else
+			str = t_strconcat(cmd->name, "\r\n", NULL);
+		break;
+	}
+	o_stream_nsend_str(client->output, str);
+}
+
+static void imap_append_quoted(string_t *str, const char *value,
+			       size_t len)
+{
+	size_t i;
+
+	str_append_c(str, '"');
+	for (i = 0; i < len; i++) {
+		if (value[i] == '"' || value[i] == '\\')
+			str_append_c(str, '\\');
+		str_append_c(str, value[i]);
+	}
+	str_append_c(str, '"');
+}
+
+/* Append the selected messages as a sequence set, e.g. "1:3,7" */
+static void imap_append_seqset(string_t *str, const ARRAY_TYPE(uint) *msgnums)
+{
+	const unsigned int *nums;
+	unsigned int i, j, count;
+
+	nums = array_get(msgnums, &count);
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && nums[j] == nums[j - 1] + 1; j++) ;
+		if (i > 0)
+			str_append_c(str, ',');
+		if (j - 1 == i)
+			str_printfa(str, "%u", nums[i]);
+		else
+			str_printfa(str, "%u:%u", nums[i], nums[j - 1]);
+	}
+}
+
+static void client_send_imap_cmd(struct client *client)
+{
+	const struct scenario_step *step = client_step(client);
+	const struct client_command *cmd = &client_commands[step->cmd];
+	string_t *str = t_str_new(128);
+	const char *flags;
+
+	str_printfa(str, "a%u ", client->next_tag++);
+	switch (step->cmd) {
+	case IMAP_CMD_LOGIN:
+		str_append(str, "LOGIN ");
+		imap_append_quoted(str, client->username,
+				   strlen(client->username));
+		str_append_c(str, ' ');
+		imap_append_quoted(str, client->password,
+				   client->password_len);
+		break;
+	case IMAP_CMD_SELECT:
+		str_append(str, "SELECT ");
+		imap_append_quoted(str, step->arg, strlen(step->arg));
+		break;
+	case IMAP_CMD_FETCH:
+		str_append(str, "FETCH ");
+		imap_append_seqset(str, &client->msgnums);
+		if (strchr(step->arg, ' ') == NULL)
+			str_printfa(str, " %s", step->arg);
+		else
+			str_printfa(str, " (%s)", step->arg);
+		break;
+	case IMAP_CMD_STORE:
+		str_append(str, "STORE ");
+		imap_append_seqset(str, &client->msgnums);
+		flags = step->arg;
+		if (*flags == '+' || *flags == '-')
+			flags++;
+		str_printfa(str, " %cFLAGS.SILENT (%s)",
+			    step->arg[0] == '-' ? '-' : '+', flags);
+		break;
+	case IMAP_CMD_SEARCH:
+		str_printfa(str, "UID SEARCH %s", step->arg);
+		break;
+	default:
+		str_append(str, cmd->name);
+		break;
+	}
+	str_append(str, "\r\n");
+	o_stream_nsend(client->output, str_data(str), str_len(str));
+}
+
+static void client_send_cmd(struct client *client, unsigned int idx)
+{
+	if (protocol == CLIENT_PROTOCOL_POP3)
+		client_send_pop3_cmd(client, idx);
+	else
+		client_send_imap_cmd(client);
+}
+
+static void client_send_more(struct client *client)
+{
+	const struct scenario_step *step = client_step(client);
+	unsigned int max_sent = client->cmds_count;
+
+	if (pipeline_depth > 0 &&
+	    COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_PER_MESSAGE)) {
+		max_sent = I_MIN(max_sent,
+				 client->replies_received + pipeline_depth);
+	}
+
+	o_stream_cork(client->output);
+	while (client->cmds_sent < max_sent) {
+		T_BEGIN {
+			client_send_cmd(client, client->cmds_sent);
+		} T_END;
+		client->cmds_sent++;
+	}
+	o_stream_uncork(client->output);
+	client->last_send_usecs = clock_usecs();
+}
+
+static void client_step_send(struct client *client)
+{
+	timeout_remove(&client->to_delay);
+	client->reply_start_usecs = client->step_start_usecs = clock_usecs();
+	client_send_more(client);
+}
+
+static void client_step_start(struct client *client)
+{
+	const struct scenario_step *step;
+
+	for (;; client->step_idx++) {
+		step = client_step(client);
+		client->cmds_sent = client->replies_received = 0;
+		client->tag_base = client->next_tag;
+		if (step->raw_line != NULL ||
+		    !COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_PER_MESSAGE)) {
+			client->cmds_count = 1;
+			break;
+		}
+		client_select_messages(client, step);
+		client->cmds_count = array_count(&client->msgnums);
+		if (protocol == CLIENT_PROTOCOL_IMAP &&
+		    client->cmds_count > 0) {
+			/* all of them in a single sequence set */
+			client->cmds_count = 1;
+		}
+		if (client->cmds_count > 0)
+			break;
+		/* no messages selected, skip the step. the last step is
+		   always QUIT/LOGOUT, so this terminates. */
+	}
+
+	if (step->delay_usecs > 0 && rawlog_scale > 0) {
+		uint64_t send_usecs = client->last_send_usecs +
+			step->delay_usecs * rawlog_scale;
+		uint64_t now = clock_usecs();
+
+		if (send_usecs > now + 1000) {
+			client->to_delay =
+				timeout_add((send_usecs - now) / 1000,
+					    client_step_send, client);
+			return;
+		}
+	}
+	client_step_send(client);
+}
+
+/* The full reply to the current command has been received. Returns -1 if
+   the client was freed. */
+static int client_reply_finished(struct client *client)
+{
+	const struct scenario_step *step = client_step(client);
+	uint64_t now = clock_usecs();
+
+	histogram_add(&stats->latency[step->cmd],
+		      now - client->reply_start_usecs);
+	if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_DOWNLOAD))
+		client->retr_usecs += now - client->reply_start_usecs;
+	client->reply_start_usecs = now;
+
+	if (++client->replies_received < client->cmds_count) {
+		if (client->cmds_sent < client->cmds_count)
+			client_send_more(client);
+		return 0;
+	}
+	if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_PER_MESSAGE) &&
+	    step->raw_line == NULL) {
+		histogram_add(&stats->step_latency[step->cmd],
+			      now - client->step_start_usecs);
+	}
+
+	switch (step->cmd) {
+	case POP3_CMD_STLS:
+	case IMAP_CMD_STARTTLS:
+		if (client_ssl_init(client) < 0) {
+			client_fail(client, CLIENT_ERROR_TLS);
+			return -1;
+		}
+		/* the login is sent via the SSL ostream once the handshake
+		   is finished */
+		break;
+	case POP3_CMD_QUIT:
+	case IMAP_CMD_LOGOUT:
+		/* wait for the server to disconnect */
+		client_session_finished(client);
+		return 0;
+	default:
+		break;
+	}
+	client->step_idx++;
+	client_step_start(client);
+	return 0;
+}
+
+/* Count a failed command. Returns -1 if the client was freed. */
+static int client_reply_failed(struct client *client, const char *line)
+{
+	const struct scenario_step *step = client_step(client);
+	const struct client_command *cmd = &client_commands[step->cmd];
+
+	stats->command_errors[step->cmd]++;
+	if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_REQUIRED)) {
+		i_error("%s: %s failed: %s", client->username,
+			cmd->name == NULL ? "Banner" : cmd->name, line);
+		client_fail(client, CLIENT_ERROR_COMMAND);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns -1 if the client was freed. */
+static int client_pop3_reply_line(struct client *client, const char *line)
+{
+	const struct scenario_step *step = client_step(client);
+
+	if (*line != '+') {
+		if (client_reply_failed(client, line) < 0)
+			return -1;
+	} else if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_MULTILINE) &&
+		   !step->single_line) {
+		client->in_body = TRUE;
+		client->body_line_start = TRUE;
+		client->body_lines = 0;
+		return 0;
+	} else if (step->cmd == POP3_CMD_STAT) {
+		if (sscanf(line, "+OK %u", &client->messages) != 1)
+			client->messages = 0;
+	}
+	return client_reply_finished(client);
+}
+
+static void client_idle_done(struct client *client)
+{
+	timeout_remove(&client->to_idle);
+	o_stream_nsend_str(client->output, "DONE\r\n");
+	/* IDLE's latency is from DONE to the tagged reply */
+	client->reply_start_usecs = clock_usecs();
+}
+
+/* Start skipping the literal if the line ends with {size} or {size+}. */
+static void imap_line_literal(struct client *client, const char *line)
+{
+	const char *p;
+	uoff_t size = 0;
+
+	p = strrchr(line, '{');
+	if (p == NULL)
+		return;
+	for (p++; *p >= '0' && *p <= '9'; p++)
+		size = size * 10 + (*p - '0');
+	if (*p == '+')
+		p++;
+	if (p[0] != '}' || p[1] != '\0' || p[-1] == '{')
+		return;
+	client->literal_left = size;
+	client->literal_continues = TRUE;
+	if (size == 0) {
+		/* {0} has nothing to skip, but it's still a message */
+		client_literal_count(client, 0);
+	}
+}
+
+static void imap_untagged(struct client *client, const char *line)
+{
+	unsigned int num;
+	char *end;
+
+	num = strtoul(line, &end, 10);
+	if (end == line)
+		return;
+	if (strcmp(end, " EXISTS") == 0)
+		client->messages = num;
+	else if (strcmp(end, " EXPUNGE") == 0 && client->messages > 0)
+		client->messages--;
+}
+
+/* Returns -1 if the client was freed. */
+static int client_imap_reply_line(struct client *client, const char *line)
+{
+	const struct scenario_step *step = client_step(client);
+	unsigned int tag;
+	char *end;
+
+	if (client->literal_continues) {
+		/* rest of an untagged reply after a literal */
+		client->literal_continues = FALSE;
+		imap_line_literal(client, line);
+		return 0;
+	}
+	if (step->cmd == IMAP_CMD_BANNER) {
+		if (strncmp(line, "* OK", 4) != 0 &&
+		    strncmp(line, "* PREAUTH", 9) != 0) {
+			if (client_reply_failed(client, line) < 0)
+				return -1;
+		}
+		return client_reply_finished(client);
+	}
+	if (line[0] == '*' && line[1] == ' ') {
+		imap_untagged(client, line + 2);
+		imap_line_literal(client, line);
+		return 0;
+	}
+	if (line[0] == '+') {
+		if (step->cmd == IMAP_CMD_IDLE && client->to_idle == NULL) {
+			client->to_idle = timeout_add(step->idle_secs * 1000,
+						      client_idle_done, client);
+		}
+		return 0;
+	}
+
+	if (line[0] != 'a' ||
+	    (tag = strtoul(line + 1, &end, 10), end == line + 1) ||
+	    *end != ' ' || tag < client->tag_base ||
+	    tag - client->tag_base >= client->cmds_sent) {
+		i_error("%s: Unexpected reply: %s", client->username, line);
+		client_fail(client, CLIENT_ERROR_PROTOCOL);
+		return -1;
+	}
+	/* IDLE may have been finished (or refused) without our DONE */
+	timeout_remove(&client->to_idle);
+	if (strncmp(end + 1, "OK", 2) != 0) {
+		if (client_reply_failed(client, line) < 0)
+			return -1;
+	}
+	return client_reply_finished(client);
+}
+
+static void client_input(struct client *client)
+{
+	const struct scenario_step *step;
+	const char *line;
+	int ret;
+
+	switch (i_stream_read(client->input)) {
+	case 0:
+		return;
+	case -1:
+		/* disconnected */
+		if (client->step_idx + 1 != client->scenario->steps_count ||
+		    client->replies_received == 0) {
+			i_error("%s: Disconnected unexpectedly: %s",
+				client->username,
+				client->input->stream_errno == 0 ? "EOF" :
+				i_stream_get_error(client->input));
+			client_fail(client, CLIENT_ERROR_DISCONNECT);
+		} else {
+			client_free(client);
+		}
+		return;
+	case -2:
+		/* buffer full */
+		i_error("line too long");
+		client_fail(client, CLIENT_ERROR_PROTOCOL);
+		return;
+	}
+
+	for (;;) {
+		if (client->literal_left > 0) {
+			if (!client_literal_skip(client))
+				break;
+		} else if (client->in_body) {
+			if (!client_body_skip(client))
+				break;
+			client->in_body = FALSE;
+			step = client_step(client);
+			if (COMMAND_HAS_FLAG(step->cmd,
+					     COMMAND_FLAG_COUNTS_MESSAGES))
+				client->messages = client->body_lines;
+			if (client_reply_finished(client) < 0)
+				return;
+		} else {
+			/* after STLS this is already the SSL istream, which
+			   has nothing buffered yet */
+			if ((line = i_stream_next_line(client->input)) == NULL)
+				break;
+			if (protocol == CLIENT_PROTOCOL_POP3)
+				ret = client_pop3_reply_line(client, line);
+			else
+				ret = client_imap_reply_line(client, line);
+			if (ret < 0)
+				return;
+		}
+	}
+}
+
+static const struct scenario *scenario_choose(struct rng *rng)
+{
+	unsigned int i, n;
+
+	n = rng_next(rng) % scenarios_total_weight;
+	for (i = 0; i < scenarios_count; i++) {
+		if (n < scenarios[i].weight)
+			return &scenarios[i];
+		n -= scenarios[i].weight;
+	}
+	i_unreached();
+}
+
+static void client_connected(struct client *client)
+{
+	int err;
+
+	io_remove(&client->io);
+	err = net_geterror(client->fd);
+	if (err != 0) {
+		i_error("connect() failed: %s", strerror(err));
+		client_fail(client, CLIENT_ERROR_CONNECT);
+		return;
+	}
+	if (client_ssl_init(client) < 0)
+		client_fail(client, CLIENT_ERROR_TLS);
+}
+
+/* Pick the session's user. The username is allocated, the password points
+   to the users file or --password. */
+static void session_user_choose(struct rng *rng, const char *fixed_username,
+				char **username_r, const char **password_r,
+				unsigned int *password_len_r)
+{
+	const struct user *user;
+
+	*password_r = NULL;
+	if (fixed_username != NULL)
+		*username_r = i_strdup(fixed_username);
+	else if (users_count > 0) {
+		user = &users[rng_next(rng) % users_count];
+		*username_r = i_strndup(user->username, user->username_len);
+		*password_r = user->password;
+		*password_len_r = user->password_len;
+	} else {
+		/* the template's %u want unsigned ints */
+		*username_r = i_strdup_printf(username_template,
+			user_range.first +
+			(unsigned int)(rng_next(rng) % user_range.count),
+			domain_range.first +
+			(unsigned int)(rng_next(rng) % domain_range.count));
+	}
+	if (*password_r == NULL) {
+		*password_r = password;
+		*password_len_r = strlen(password);
+	}
+}
+
+struct client *client_new(uint64_t intended_start_usecs)
+{
+	struct client *client;
+	struct rng rng;
+	unsigned int host_idx;
+	int fd;
+
+	/* take the seed even if the connect fails, so the following
+	   sessions stay the same */
+	rng_init(&rng, rng_next(&session_rng));
+	host_idx = next_host_idx++ % hosts_count;
+	fd = net_connect_ip(&hosts[host_idx], port, NULL);
+	if (fd < 0) {
+		i_error("connect() failed: %m");
+		stats->errors++;
+		stats->error_types[CLIENT_ERROR_CONNECT]++;
+		return NULL;
+	}
+
+	client = i_new(struct client, 1);
+	client->fd = fd;
+	client->host_idx = host_idx;
+	client->input = i_stream_create_fd(fd, 65536);
+	client->output = o_stream_create_fd(fd, SIZE_MAX);
+	o_stream_set_no_error_handling(client->output, TRUE);
+	if (ssl_mode == SSL_MODE_IMMEDIATE) {
+		/* start the handshake only after the TCP connection is up
+		   so its time isn't included */
+		client->io = io_add(fd, IO_WRITE, client_connected, client);
+	} else {
+		client->io = io_add_istream(client->input, client_input,
+					    client);
+	}
+	client->intended_start_usecs = intended_start_usecs;
+
+	/* wait for the banner. in open loop mode its latency includes any
+	   delay in getting the session started. */
+	client->rng = rng;
+	if (rawlog_sessions_count > 0) {
+		/* each worker replays every workers_count'th session */
+		client->scenario = &rawlog_sessions[rawlog_next_idx];
+		rawlog_next_idx = (rawlog_next_idx + workers_count) %
+			rawlog_sessions_count;
+		client->scenario_idx = 0;
+	} else {
+		client->scenario = scenario_choose(&client->rng);
+		client->scenario_idx = client->scenario - scenarios;
+	}
+	client->cmds_count = client->cmds_sent = 1;
+	client->reply_start_usecs = intended_start_usecs;
+	i_array_init(&client->msgnums, 16);
+	session_user_choose(&client->rng, client->scenario->username,
+			    &client->username, &client->password,
+			    &client->password_len);
+	clients_count++;
+	stats->connections++;
+	stats->active_sessions = clients_count;
+	return client;
+}
+
+/* How much of the full load should be running now, 0..1 */
+static double run_load_fraction(void)
+{
+	double elapsed;
+
+	if (draining)
+		return 0;
+	elapsed = (clock_usecs() - run_phase_start_usecs) / 1000000.0;
+	switch (run_phase) {
+	case RUN_PHASE_RAMP_UP:
+		return I_MIN(elapsed / ramp_up_secs, 1.0);
+	case RUN_PHASE_STEADY:
+		return 1;
+	case RUN_PHASE_RAMP_DOWN:
+		return I_MAX(1 - elapsed / ramp_down_secs, 0.0);
+	case RUN_PHASE_COUNT:
+		break;
+	}
+	i_unreached();
+}
+
+/* Closed loop: number of sessions that should be running now */
+static unsigned int clients_target(void)
+{
+	return (unsigned int)ceil(worker_clients_count * run_load_fraction());
+}
+
+#ifdef POP3TEST_IO_URING
+static int sys_io_uring_setup(unsigned int entries,
+			      struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+				 const void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_handle_completions(void);
+
+static void uring_submit(void)
+{
+	int ret;
+
+	timeout_remove(&uring.to_submit);
+	while (uring.queued > 0) {
+		ret = sys_io_uring_enter(uring.fd, uring.queued, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) {
+				/* completion queue is full, try again after
+				   it has been emptied */
+				break;
+			}
+			i_fatal("io_uring_enter() failed: %m");
+		}
+		uring.queued -= ret;
+	}
+}
+
+static void uring_submit_timeout(void *context ATTR_UNUSED)
+{
+	/* also handles the completions uring_get_sqe() reaped */
+	uring_handle_completions();
+}
+
+/* Move the completions out of the ring, so the kernel has room to post
+   more. They're handled by uring_handle_completions(). Returns the number
+   of completions moved. */
+static unsigned int uring_reap(void)
+{
+	unsigned int head, count = 0;
+
+	head = *uring.cq_head;
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		array_push_back(&uring.reaped,
+				&uring.cqes[head & uring.cq_mask]);
+		__atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+		count++;
+	}
+	return count;
+}
+
+static bool uring_sq_full(void)
+{
+	return *uring.sq_tail -
+		__atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) ==
+		uring.sq_entries;
+}
+
+/* Returns a zeroed SQE, which is submitted with everything else queued
+   during this ioloop run. */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	while (uring_sq_full()) {
+		uring_submit();
+		if (!uring_sq_full())
+			break;
+		/* the kernel refuses more submissions until the completion
+		   queue has room. That's back-pressure, so make the room
+		   and try again. Give up only if nothing changes. */
+		if (uring_reap() == 0)
+			i_fatal("io_uring submission queue is stuck");
+	}
+	tail = *uring.sq_tail;
+	idx = tail & uring.sq_mask;
+	sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.queued++;
+	if (uring.to_submit == NULL) {
+		uring.to_submit = timeout_add_short(0, uring_submit_timeout,
+						    NULL);
+	}
+	return sqe;
+}
+
+static void uring_provide_buffers(unsigned int bid, unsigned int count)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (uintptr_t)(uring.bufs + bid * URING_BUF_SIZE);
+	sqe->len = URING_BUF_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = URING_BUF_GROUP;
+}
+
+static void uring_client_recv(struct uring_client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	client->op = URING_OP_RECV;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->len = URING_BUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = (uintptr_t)client;
+}
+
+static void uring_client_send_more(struct uring_client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	client->op = URING_OP_SEND;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = client->fd;
+	sqe->addr = (uintptr_t)(client->send_buf + client->send_offset);
+	sqe->len = client->send_len - client->send_offset;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)client;
+}
+
+static void uring_client_send(struct uring_client *client,
+			      enum client_cmd cmd, const char *str)
+{
+	i_free(client->send_buf);
+	client->send_buf = i_strdup(str);
+	client->send_len = strlen(str);
+	client->send_offset = 0;
+	client->cmd = cmd;
+	uring_client_send_more(client);
+}
+
+static void uring_client_destroy(struct uring_client *client)
+{
+	--clients_count;
+	stats->active_sessions = clients_count;
+	DLLIST_REMOVE(&uring.clients, client);
+	if (close(client->fd) < 0)
+		i_error("close() failed: %m");
+	i_free(client->send_buf);
+	i_free(client->username);
+	i_free(client);
+}
+
+static void uring_client_free(struct uring_client *client)
+{
+	uring_client_destroy(client);
+	client_replace();
+}
+
+static void uring_client_fail(struct uring_client *client,
+			      enum client_error error)
+{
+	stats->errors++;
+	stats->error_types[error]++;
+	uring_client_free(client);
+}
+
+/* Returns -1 if the client was freed. */
+static int uring_client_reply(struct uring_client *client, const char *line)
+{
+	uint64_t now = clock_usecs();
+
+	histogram_add(&stats->latency[client->cmd],
+		      now - client->reply_start_usecs);
+	if (*line != '+') {
+		stats->command_errors[client->cmd]++;
+		if (COMMAND_HAS_FLAG(client->cmd, COMMAND_FLAG_REQUIRED)) {
+			i_error("%s: %s failed: %s", client->username,
+				client->cmd == POP3_CMD_BANNER ? "Banner" :
+				client_commands[client->cmd].name, line);
+			uring_client_fail(client, CLIENT_ERROR_COMMAND);
+			return -1;
+		}
+	}
+
+	switch (client->cmd) {
+	case POP3_CMD_BANNER:
+		uring_client_send(client, POP3_CMD_USER, t_strdup_printf(
+			"USER %s\r\n", client->username));
+		break;
+	case POP3_CMD_USER:
+		uring_client_send(client, POP3_CMD_PASS, t_strdup_printf(
+			"PASS %.*s\r\n", (int)client->password_len,
+			client->password));
+		break;
+	case POP3_CMD_PASS:
+		uring_client_send(client, POP3_CMD_QUIT, "QUIT\r\n");
+		break;
+	case POP3_CMD_QUIT:
+		/* wait for the server to disconnect */
+		now -= client->intended_start_usecs;
+		stats->sessions++;
+		histogram_add(&stats->session_latency, now);
+		histogram_add(&stats->scenario_latency[0], now);
+		client->quit_replied = TRUE;
+		uring_client_recv(client);
+		break;
+	default:
+		i_unreached();
+	}
+	return 0;
+}
+
+/* Returns -1 if the client was freed. */
+static int uring_client_input(struct uring_client *client,
+			      const unsigned char *data, size_t size)
+{
+	const unsigned char *nl;
+	size_t len;
+	int ret;
+
+	if (client->quit_replied) {
+		/* ignore anything after QUIT's reply */
+		uring_client_recv(client);
+		return 0;
+	}
+	nl = memchr(data, '\n', size);
+	len = nl == NULL ? size : (size_t)(nl - data);
+	if (client->line_len + len >= sizeof(client->line)) {
+		i_error("line too long");
+		uring_client_fail(client, CLIENT_ERROR_PROTOCOL);
+		return -1;
+	}
+	memcpy(client->line + client->line_len, data, len);
+	client->line_len += len;
+	if (nl == NULL) {
+		uring_client_recv(client);
+		return 0;
+	}
+	/* the server doesn't send anything else before our next command */
+	if (client->line_len > 0 && client->line[client->line_len-1] == '\r')
+		client->line_len--;
+	client->line[client->line_len] = '\0';
+	client->line_len = 0;
+	T_BEGIN {
+		ret = uring_client_reply(client, client->line);
+	} T_END;
+	return ret;
+}
+
+static void uring_client_cqe(struct uring_client *client,
+			     const struct io_uring_cqe *cqe)
+{
+	unsigned int bid;
+
+	switch (client->op) {
+	case URING_OP_CONNECT:
+		if (cqe->res < 0) {
+			i_error("connect() failed: %s", strerror(-cqe->res));
+			uring_client_fail(client, CLIENT_ERROR_CONNECT);
+			return;
+		}
+		/* banner */
+		uring_client_recv(client);
+		return;
+	case URING_OP_SEND:
+		if (cqe->res < 0) {
+			i_error("%s: send() failed: %s", client->username,
+				strerror(-cqe->res));
+			uring_client_fail(client, CLIENT_ERROR_DISCONNECT);
+			return;
+		}
+		client->send_offset += cqe->res;
+		if (client->send_offset < client->send_len) {
+			uring_client_send_more(client);
+			return;
+		}
+		client->reply_start_usecs = clock_usecs();
+		uring_client_recv(client);
+		return;
+	case URING_OP_RECV:
+		break;
+	}
+
+	if (cqe->res == -ENOBUFS) {
+		/* all the buffers are in completions we haven't handled yet.
+		   Retry after they've been given back. */
+		array_push_back(&uring.buf_waiters, &client);
+		return;
+	}
+	if (cqe->res <= 0) {
+		if (cqe->res == 0 && client->quit_replied) {
+			uring_client_free(client);
+			return;
+		}
+		i_error("%s: Disconnected unexpectedly: %s", client->username,
+			cqe->res == 0 ? "EOF" : strerror(-cqe->res));
+		uring_client_fail(client, CLIENT_ERROR_DISCONNECT);
+		return;
+	}
+	i_assert((cqe->flags & IORING_CQE_F_BUFFER) != 0);
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	(void)uring_client_input(client, uring.bufs + bid * URING_BUF_SIZE,
+				 cqe->res);
+	/* the data was copied, give the buffer back */
+	uring_provide_buffers(bid, 1);
+}
+
+static void uring_handle_completions(void)
+{
+	struct io_uring_cqe cqe;
+	struct uring_client *const *waiters;
+	unsigned int i = 0, j, count;
+
+	/* the handlers may reap more while waiting for SQ space, those are
+	   appended and handled in this same loop */
+	(void)uring_reap();
+	do {
+		for (; i < array_count(&uring.reaped); i++) {
+			cqe = *array_idx(&uring.reaped, i);
+			if (cqe.user_data != 0) {
+				uring_client_cqe(
+					(void *)(uintptr_t)cqe.user_data, &cqe);
+			} else if (cqe.res < 0) {
+				i_fatal("io_uring buffer registration "
+					"failed: %s", strerror(-cqe.res));
+			}
+		}
+
+		/* the buffers have been given back now */
+		waiters = array_get(&uring.buf_waiters, &count);
+		for (j = 0; j < count; j++)
+			uring_client_recv(waiters[j]);
+		array_clear(&uring.buf_waiters);
+	} while (i < array_count(&uring.reaped));
+	array_clear(&uring.reaped);
+
+	/* send everything the completions triggered with one syscall */
+	uring_submit();
+}
+
+static void uring_completions(void *context ATTR_UNUSED)
+{
+	uint64_t value;
+
+	if (read(uring.eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		i_fatal("read(io_uring eventfd) failed: %m");
+	uring_handle_completions();
+}
+
+static bool uring_client_new(uint64_t intended_start_usecs)
+{
+	struct uring_client *client;
+	struct io_uring_sqe *sqe;
+	struct rng rng;
+	unsigned int host_idx;
+	int fd;
+
+	/* take the seed even if the socket creation fails, so the following
+	   sessions stay the same */
+	rng_init(&rng, rng_next(&session_rng));
+	host_idx = next_host_idx++ % hosts_count;
+	fd = socket(uring.addrs[host_idx].ss_family, SOCK_STREAM | SOCK_CLOEXEC,
+		    0);
+	if (fd < 0) {
+		i_error("socket() failed: %m");
+		stats->errors++;
+		stats->error_types[CLIENT_ERROR_CONNECT]++;
+		return FALSE;
+	}
+
+	client = i_new(struct uring_client, 1);
+	DLLIST_PREPEND(&uring.clients, client);
+	client->fd = fd;
+	client->rng = rng;
+	client->cmd = POP3_CMD_BANNER;
+	client->intended_start_usecs = intended_start_usecs;
+	/* the banner latency includes the connect */
+	client->reply_start_usecs = intended_start_usecs;
+	session_user_choose(&client->rng, NULL, &client->username,
+			    &client->password, &client->password_len);
+
+	client->op = URING_OP_CONNECT;
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&uring.addrs[host_idx];
+	sqe->off = uring.addr_lens[host_idx];
+	sqe->user_data = (uintptr_t)client;
+
+	clients_count++;
+	stats->connections++;
+	stats->active_sessions = clients_count;
+	return TRUE;
+}
+
+static void uring_addrs_init(void)
+{
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	unsigned int i;
+
+	uring.addrs = i_new(struct sockaddr_storage, hosts_count);
+	uring.addr_lens = i_new(socklen_t, hosts_count);
+	for (i = 0; i < hosts_count; i++) {
+		if (hosts[i].family == AF_INET6) {
+			sin6 = (struct sockaddr_in6 *)&uring.addrs[i];
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr = hosts[i].u.ip6;
+			sin6->sin6_port = htons(port);
+			uring.addr_lens[i] = sizeof(*sin6);
+		} else {
+			sin = (struct sockaddr_in *)&uring.addrs[i];
+			sin->sin_family = AF_INET;
+			sin->sin_addr = hosts[i].u.ip4;
+			sin->sin_port = htons(port);
+			uring.addr_lens[i] = sizeof(*sin);
+		}
+	}
+}
+
+static void *uring_mmap(size_t size, off_t offset)
+{
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, uring.fd, offset);
+	if (map == MAP_FAILED)
+		i_fatal("mmap(io_uring) failed: %m");
+	return map;
+}
+
+static void uring_init(void)
+{
+	struct io_uring_params params;
+	unsigned char *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	/* connections that are waiting for a reply all have a recv
+	   pending, so make the completion queue as large as possible */
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = URING_CQ_ENTRIES;
+	uring.fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+	if (uring.fd < 0)
+		i_fatal("io_uring_setup() failed: %m");
+	if ((params.features & IORING_FEAT_NODROP) == 0)
+		i_fatal("io_uring: Kernel is too old (no IORING_FEAT_NODROP)");
+
+	uring.sq_map_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	uring.cq_map_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sq_map = uring_mmap(uring.sq_map_size, IORING_OFF_SQ_RING);
+	uring.cq_map = uring_mmap(uring.cq_map_size, IORING_OFF_CQ_RING);
+	uring.sqes = uring_mmap(uring.sqes_size, IORING_OFF_SQES);
+
+	sq = uring.sq_map;
+	uring.sq_head = (unsigned int *)(sq + params.sq_off.head);
+	uring.sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	uring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+	uring.sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	uring.sq_entries = params.sq_entries;
+	cq = uring.cq_map;
+	uring.cq_head = (unsigned int *)(cq + params.cq_off.head);
+	uring.cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	uring.cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	/* completions wake up the ioloop, so timeouts, signals and the
+	   reporting keep working as with the ioloop engine */
+	uring.eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (uring.eventfd < 0)
+		i_fatal("eventfd() failed: %m");
+	if (sys_io_uring_register(uring.fd, IORING_REGISTER_EVENTFD,
+				  &uring.eventfd, 1) < 0)
+		i_fatal("io_uring_register(EVENTFD) failed: %m");
+	uring.io = io_add(uring.eventfd, IO_READ, uring_completions, NULL);
+
+	i_array_init(&uring.reaped, 64);
+	i_array_init(&uring.buf_waiters, 16);
+	uring.bufs = i_malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+	uring_provide_buffers(0, URING_BUF_COUNT);
+	uring_addrs_init();
+}
+
+static void uring_deinit(void)
+{
+	/* close the ring first, which cancels the sessions' operations so
+	   their buffers can be freed */
+	io_remove(&uring.io);
+	timeout_remove(&uring.to_submit);
+	i_close_fd(&uring.fd);
+	while (uring.clients != NULL)
+		uring_client_destroy(uring.clients);
+	array_free(&uring.reaped);
+	array_free(&uring.buf_waiters);
+	i_close_fd(&uring.eventfd);
+	(void)munmap(uring.sq_map, uring.sq_map_size);
+	(void)munmap(uring.cq_map, uring.cq_map_size);
+	(void)munmap(uring.sqes, uring.sqes_size);
+	i_free(uring.bufs);
+	i_free(uring.addrs);
+	i_free(uring.addr_lens);
+}
+#endif
+
+/* Start a session with the --engine. Returns FALSE if it couldn't even
+   be started (the error is already counted). */
+static bool session_start(uint64_t intended_start_usecs)
+{
+#ifdef POP3TEST_IO_URING
+	if (engine == CLIENT_ENGINE_IO_URING)
+		return uring_client_new(intended_start_usecs);
+#endif
+	return client_new(intended_start_usecs) != NULL;
+}
+
+static void clients_adjust(void)
+{
+	unsigned int target = clients_target();
+
+	while (clients_count < target) {
+		if (!session_start(clock_usecs()))
+			break;
+	}
+}
+
+/* A session has ended: stop if draining, or replace it in closed loop
+   mode. */
+static void client_replace(void)
+{
+	if (draining) {
+		if (clients_count == 0)
+			io_loop_stop(ioloop);
+	} else if (arrival_rate == 0 && clients_count < clients_target()) {
+		(void)session_start(clock_usecs());
+	}
+}
+
+void client_free(struct client *client)
+{
+	--clients_count;
+	stats->active_sessions = clients_count;
+	if (client->ssl_iostream != NULL) {
+		if (ssl_resume)
+			client_ssl_save_session(client);
+		ssl_iostream_destroy(&client->ssl_iostream);
+	}
+	io_remove(&client->io);
+	timeout_remove(&client->to_idle);
+	timeout_remove(&client->to_delay);
+	o_stream_destroy(&client->output);
+	i_stream_destroy(&client->input);
+	net_disconnect(client->fd);
+	array_free(&client->msgnums);
+	i_free(client->username);
+	i_free(client);
+	client_replace();
+}
+
+static uint64_t arrival_interval_usecs(void)
+{
+	double u, interval = 1000000.0 / worker_arrival_rate;
+
+	if (arrival_poisson) {
+		/* exponentially distributed inter-arrival times,
+		   u is in (0, 1] */
+		u = 1.0 - rng_double(&arrival_rng);
+		interval *= -log(u);
+	}
+	return interval;
+}
+
+static void arrivals_schedule(void);
+
+static void arrival_timeout(void *context ATTR_UNUSED)
+{
+	uint64_t now = clock_usecs();
+
+	timeout_remove(&to_arrival);
+
+	/* start everything that is due, even if we're late. the sessions'
+	   latencies are measured from when they should have started. */
+	while (next_arrival_usecs <= now) {
+		/* always draw, so the arrivals after the ramp are the same
+		   regardless of its length */
+		if (rng_double(&arrival_rng) >= run_load_fraction()) {
+			/* thinned out to follow the ramp */
+		} else if (clients_count >= max_sessions) {
+			/* skip its seed so the following sessions stay the
+			   same */
+			(void)rng_next(&session_rng);
+			stats->dropped++;
+		}
+		else
+			(void)session_start((uint64_t)next_arrival_usecs);
+		next_arrival_usecs += arrival_interval_usecs();
+	}
+	arrivals_schedule();
+}
+
+static void arrivals_schedule(void)
+{
+	uint64_t now = clock_usecs();
+	unsigned int msecs = 0;
+
+	if (next_arrival_usecs > now)
+		msecs = ((uint64_t)next_arrival_usecs - now + 999) / 1000;
+	to_arrival = timeout_add(msecs, arrival_timeout, NULL);
+}
+
+static void arrivals_start(unsigned int worker_idx)
+{
+	worker_arrival_rate = arrival_rate / workers_count;
+	next_arrival_usecs = clock_usecs();
+	if (arrival_poisson)
+		next_arrival_usecs += arrival_interval_usecs();
+	else {
+		/* spread the workers' constant arrivals evenly */
+		next_arrival_usecs += worker_idx * 1000000.0 / arrival_rate;
+	}
+	arrivals_schedule();
+}
+
+static void sig_print_stats(const siginfo_t *si ATTR_UNUSED,
+			    void *context ATTR_UNUSED)
+{
+	stats_print_total();
+}
+
+static void run_phase_set(enum run_phase phase)
+{
+	uint64_t now = clock_usecs();
+
+	if (stats != NULL) {
+		stats->phase_end_usecs = now;
+		stats->active_sessions = 0;
+	}
+	run_phase = phase;
+	run_phase_start_usecs = now;
+	stats = worker_phase_stats(current_worker_idx, phase);
+	stats->phase_start_usecs = now;
+	stats->active_sessions = clients_count;
+}
+
+static void drain_timeout(void *context ATTR_UNUSED)
+{
+	i_warning("%u sessions still running after --drain-timeout",
+		  clients_count);
+	io_loop_stop(ioloop);
+}
+
+/* Stop starting new sessions and stop once the running ones are done. */
+static void run_drain(void)
+{
+	draining = TRUE;
+	timeout_remove(&to_arrival);
+	timeout_remove(&to_ramp);
+	timeout_remove(&to_phase);
+	if (clients_count == 0 || drain_timeout_secs == 0)
+		io_loop_stop(ioloop);
+	else {
+		to_phase = timeout_add(drain_timeout_secs * 1000,
+				       drain_timeout, NULL);
+	}
+}
+
+static void run_phase_timeout(void *context ATTR_UNUSED)
+{
+	timeout_remove(&to_phase);
+	timeout_remove(&to_ramp);
+
+	switch (run_phase) {
+	case RUN_PHASE_RAMP_UP:
+		run_phase_set(RUN_PHASE_STEADY);
+		if (arrival_rate == 0)
+			clients_adjust();
+		if (duration_secs > 0) {
+			to_phase = timeout_add(duration_secs * 1000,
+					       run_phase_timeout, NULL);
+		}
+		break;
+	case RUN_PHASE_STEADY:
+		if (ramp_down_secs == 0) {
+			run_drain();
+			break;
+		}
+		/* closed loop sessions just aren't replaced */
+		run_phase_set(RUN_PHASE_RAMP_DOWN);
+		to_phase = timeout_add(ramp_down_secs * 1000,
+				       run_phase_timeout, NULL);
+		break;
+	case RUN_PHASE_RAMP_DOWN:
+		run_drain();
+		break;
+	case RUN_PHASE_COUNT:
+		i_unreached();
+	}
+}
+
+static void ramp_timeout(void *context ATTR_UNUSED)
+{
+	clients_adjust();
+}
+
+static void run_phases_start(void)
+{
+	if (ramp_up_secs == 0) {
+		/* start directly in the steady state */
+		run_phase = RUN_PHASE_RAMP_UP;
+		run_phase_timeout(NULL);
+		return;
+	}
+	run_phase_set(RUN_PHASE_RAMP_UP);
+	to_phase = timeout_add(ramp_up_secs * 1000, run_phase_timeout, NULL);
+	if (arrival_rate == 0) {
+		to_ramp = timeout_add(RAMP_INTERVAL_MSECS, ramp_timeout, NULL);
+		clients_adjust();
+	}
+}
+
+static void sig_die(const siginfo_t *si ATTR_UNUSED, void *context ATTR_UNUSED)
+{
+	if (!draining)
+		run_drain();
+	else
+		io_loop_stop(ioloop);
+}
+
+static void ssl_init(void)
+{
+	struct ssl_iostream_settings ssl_set;
+	const char *error;
+
+	memset(&ssl_set, 0, sizeof(ssl_set));
+	ssl_set.allow_invalid_cert = TRUE;
+	ssl_set.tickets = ssl_tickets;
+	if (ssl_iostream_context_init_client(&ssl_set, &ssl_ctx, &error) < 0)
+		i_fatal("Couldn't initialize SSL context: %s", error);
+	ssl_sessions = i_new(SSL_SESSION *, hosts_count);
+}
+
+static void ssl_deinit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < hosts_count; i++) {
+		if (ssl_sessions[i] != NULL)
+			SSL_SESSION_free(ssl_sessions[i]);
+	}
+	i_free(ssl_sessions);
+	ssl_iostream_context_unref(&ssl_ctx);
+}
+
+static void worker_run(unsigned int worker_idx, unsigned int count)
+{
+	ioloop = io_loop_create();
+	current_worker_idx = worker_idx;
+	worker_clients_count = count;
+
+	lib_signals_init();
+	lib_signals_set_handler(SIGINT, LIBSIG_FLAGS_SAFE, sig_die, NULL);
+	lib_signals_set_handler(SIGTERM, LIBSIG_FLAGS_SAFE, sig_die, NULL);
+	if (workers_count == 1) {
+		lib_signals_set_handler(SIGUSR1, LIBSIG_FLAGS_SAFE,
+					sig_print_stats, NULL);
+	} else {
+		/* only the parent reports */
+		lib_signals_ignore(SIGUSR1, TRUE);
+	}
+	lib_signals_ignore(SIGPIPE, TRUE);
+
+	if (ssl_mode != SSL_MODE_NONE)
+		ssl_init();
+
+	if (workers_count == 1)
+		reporting_init();
+#ifdef POP3TEST_IO_URING
+	if (engine == CLIENT_ENGINE_IO_URING)
+		uring_init();
+#endif
+	/* spread the workers' connections across the hosts */
+	next_host_idx = worker_idx;
+	if (rawlog_sessions_count > 0)
+		rawlog_next_idx = worker_idx % rawlog_sessions_count;
+	rng_init(&session_rng, seed + worker_idx * 2);
+	rng_init(&arrival_rng, seed + worker_idx * 2 + 1);
+	/* mix the state so consecutive seeds don't give related sequences */
+	rng_init(&session_rng, rng_next(&session_rng));
+	rng_init(&arrival_rng, rng_next(&arrival_rng));
+	run_phases_start();
+	if (arrival_rate > 0)
+		arrivals_start(worker_idx);
+	io_loop_run(ioloop);
+	stats->phase_end_usecs = clock_usecs();
+
+	if (workers_count == 1)
+		reporting_deinit();
+	timeout_remove(&to_arrival);
+	timeout_remove(&to_ramp);
+	timeout_remove(&to_phase);
+#ifdef POP3TEST_IO_URING
+	if (engine == CLIENT_ENGINE_IO_URING)
+		uring_deinit();
+#endif
+	if (ssl_mode != SSL_MODE_NONE)
+		ssl_deinit();
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+}
+
+static void workers_reap(void)
+{
+	unsigned int i;
+	pid_t pid;
+	int status;
+
+	/* wait only for the workers. waitpid(-1) would also reap the
+	   --serve processes, which serve_stop() waits for. */
+	for (i = 0; i < workers_count; i++) {
+		if (worker_pids[i] == 0)
+			continue;
+		pid = waitpid(worker_pids[i], &status, WNOHANG);
+		if (pid <= 0)
+			continue;
+		worker_pids[i] = 0;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			i_error("worker %u (pid %d) died", i, (int)pid);
+		workers_alive--;
+	}
+	if (workers_alive == 0)
+		io_loop_stop(ioloop);
+}
+
+static void sig_worker_exited(const siginfo_t *si ATTR_UNUSED,
+			      void *context ATTR_UNUSED)
+{
+	workers_reap();
+}
+
+static void sig_workers_stop(const siginfo_t *si, void *context ATTR_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < workers_count; i++) {
+		if (worker_pids[i] != 0)
+			(void)kill(worker_pids[i], si->si_signo);
+	}
+}
+
+static void workers_run(unsigned int clients)
+{
+	unsigned int i, count;
+	pid_t pid;
+
+	worker_pids = i_new(pid_t, workers_count);
+	for (i = 0; i < workers_count; i++) {
+		count = clients / workers_count +
+			(i < clients % workers_count ? 1 : 0);
+
+		pid = fork();
+		if (pid < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			if (metrics_fd != -1)
+				i_close_fd(&metrics_fd);
+			worker_run(i, count);
+			lib_deinit();
+			exit(0);
+		}
+		worker_pids[i] = pid;
+		workers_alive++;
+	}
+
+	ioloop = io_loop_create();
+	lib_signals_init();
+	lib_signals_set_handler(SIGINT, LIBSIG_FLAGS_SAFE,
+				sig_workers_stop, NULL);
+	lib_signals_set_handler(SIGTERM, LIBSIG_FLAGS_SAFE,
+				sig_workers_stop, NULL);
+	lib_signals_set_handler(SIGCHLD, LIBSIG_FLAGS_SAFE,
+				sig_worker_exited, NULL);
+	lib_signals_set_handler(SIGUSR1, LIBSIG_FLAGS_SAFE,
+				sig_print_stats, NULL);
+
+	reporting_init();
+
+	/* a worker may have died before the SIGCHLD handler was set */
+	workers_reap();
+	if (workers_alive > 0)
+		io_loop_run(ioloop);
+
+	reporting_deinit();
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+	i_free(worker_pids);
+}
+
+static void serve_conn_destroy(struct serve_conn *conn)
+{
+	io_remove(&conn->io);
+	o_stream_destroy(&conn->output);
+	i_stream_destroy(&conn->input);
+	net_disconnect(conn->fd);
+	i_free(conn);
+}
+
+static void serve_send(struct serve_conn *conn, const string_t *reply)
+{
+	o_stream_nsend(conn->output, str_data(reply), str_len(reply));
+}
+
+/* LIST and UIDL with a message number get a single line reply */
+static void serve_list_one(struct serve_conn *conn, const char *cmd,
+			   const char *arg)
+{
+	unsigned int seq;
+
+	if (str_to_uint(arg, &seq) < 0 || seq == 0 || seq > serve_messages) {
+		o_stream_nsend_str(conn->output, "-ERR No such message\r\n");
+		return;
+	}
+	if (strcasecmp(cmd, "LIST") == 0) {
+		o_stream_nsend_str(conn->output, t_strdup_printf(
+			"+OK %u %zu\r\n", seq, serve_retr_size));
+	} else {
+		o_stream_nsend_str(conn->output, t_strdup_printf(
+			"+OK %u uid%u\r\n", seq, seq));
+	}
+}
+
+/* RETR and TOP return the same message for every valid message number */
+static void serve_retr_one(struct serve_conn *conn, const char *cmd,
+			   const char *args)
+{
+	const char *arg;
+	unsigned int seq;
+
+	arg = args == NULL ? "" : t_strcut(args + 1, ' ');
+	if (str_to_uint(arg, &seq) < 0 || seq == 0 || seq > serve_messages) {
+		o_stream_nsend_str(conn->output, "-ERR No such message\r\n");
+		return;
+	}
+	if (strcasecmp(cmd, "RETR") == 0)
+		serve_send(conn, serve_retr);
+	else
+		serve_send(conn, serve_top);
+}
+
+static void serve_command(struct serve_conn *conn, const char *line)
+{
+	const char *args = strchr(line, ' ');
+	const char *cmd = args == NULL ? line : t_strdup_until(line, args);
+
+	if (strcasecmp(cmd, "RETR") == 0 || strcasecmp(cmd, "TOP") == 0)
+		serve_retr_one(conn, cmd, args);
+	else if ((strcasecmp(cmd, "LIST") == 0 ||
+		  strcasecmp(cmd, "UIDL") == 0) && args != NULL)
+		serve_list_one(conn, cmd, args + 1);
+	else if (strcasecmp(cmd, "LIST") == 0)
+		serve_send(conn, serve_list);
+	else if (strcasecmp(cmd, "UIDL") == 0)
+		serve_send(conn, serve_uidl);
+	else if (strcasecmp(cmd, "STAT") == 0)
+		o_stream_nsend_str(conn->output, serve_stat);
+	else if (strcasecmp(cmd, "CAPA") == 0) {
+		o_stream_nsend_str(conn->output,
+			"+OK\r\nTOP\r\nUIDL\r\nUSER\r\nPIPELINING\r\n.\r\n");
+	} else if (strcasecmp(cmd, "USER") == 0 ||
+		   strcasecmp(cmd, "PASS") == 0 ||
+		   strcasecmp(cmd, "DELE") == 0 ||
+		   strcasecmp(cmd, "NOOP") == 0 ||
+		   strcasecmp(cmd, "RSET") == 0)
+		o_stream_nsend_str(conn->output, "+OK\r\n");
+	else if (strcasecmp(cmd, "QUIT") == 0) {
+		o_stream_nsend_str(conn->output, "+OK Logging out\r\n");
+		conn->quit = TRUE;
+	} else {
+		o_stream_nsend_str(conn->output, "-ERR Unknown command\r\n");
+	}
+}
+
+static void serve_conn_input(struct serve_conn *conn);
+
+static int serve_conn_output(struct serve_conn *conn)
+{
+	int ret;
+
+	if ((ret = o_stream_flush(conn->output)) < 0) {
+		serve_conn_destroy(conn);
+		return 1;
+	}
+	if (o_stream_get_buffer_used_size(conn->output) <
+	    SERVE_OUTPUT_MAX_BUFFERED && conn->io == NULL && !conn->quit) {
+		/* continue with the pipelined commands */
+		conn->io = io_add_istream(conn->input, serve_conn_input, conn);
+		i_stream_set_input_pending(conn->input, TRUE);
+	}
+	if (ret > 0 && conn->quit) {
+		serve_conn_destroy(conn);
+		return 1;
+	}
+	return ret;
+}
+
+static void serve_conn_input(struct serve_conn *conn)
+{
+	const char *line;
+
+	switch (i_stream_read(conn->input)) {
+	case -1:
+		serve_conn_destroy(conn);
+		return;
+	case -2:
+		/* line too long */
+		serve_conn_destroy(conn);
+		return;
+	}
+
+	o_stream_cork(conn->output);
+	while (!conn->quit &&
+	       o_stream_get_buffer_used_size(conn->output) <
+	       SERVE_OUTPUT_MAX_BUFFERED &&
+	       (line = i_stream_next_line(conn->input)) != NULL) T_BEGIN {
+		serve_command(conn, line);
+	} T_END;
+	o_stream_uncork(conn->output);
+
+	if (conn->quit ||
+	    o_stream_get_buffer_used_size(conn->output) >=
+	    SERVE_OUTPUT_MAX_BUFFERED) {
+		/* wait until the output is flushed */
+		io_remove(&conn->io);
+		o_stream_set_flush_pending(conn->output, TRUE);
+	}
+}
+
+static void serve_accept(void *context ATTR_UNUSED)
+{
+	struct serve_conn *conn;
+	int fd;
+
+	fd = net_accept(serve_fd, NULL, NULL);
+	if (fd < 0) {
+		if (fd == -2)
+			i_error("accept() failed: %m");
+		return;
+	}
+	net_set_nonblock(fd, TRUE);
+
+	conn = i_new(struct serve_conn, 1);
+	conn->fd = fd;
+	conn->input = i_stream_create_fd(fd, 1024);
+	conn->output = o_stream_create_fd(fd, SIZE_MAX);
+	o_stream_set_no_error_handling(conn->output, TRUE);
+	o_stream_set_flush_callback(conn->output, serve_conn_output, conn);
+	conn->io = io_add_istream(conn->input, serve_conn_input, conn);
+	o_stream_nsend_str(conn->output, "+OK pop3test mock server ready.\r\n");
+}
+
+static void sig_serve_stop(const siginfo_t *si ATTR_UNUSED,
+			   void *context ATTR_UNUSED)
+{
+	io_loop_stop(ioloop);
+}
+
+static void serve_run(void)
+{
+	struct io *io_listen;
+
+	ioloop = io_loop_create();
+	lib_signals_init();
+	/* a terminal's SIGINT reaches us too, but the generator may still
+	   be draining its sessions. serve_stop() sends SIGTERM once it's
+	   done. */
+	lib_signals_ignore(SIGINT, TRUE);
+	lib_signals_set_handler(SIGTERM, LIBSIG_FLAGS_SAFE,
+				sig_serve_stop, NULL);
+	lib_signals_ignore(SIGUSR1, TRUE);
+	lib_signals_ignore(SIGPIPE, TRUE);
+
+	/* all the processes accept from the same listener. the connections
+	   still open at exit are simply left for the kernel to close. */
+	io_listen = io_add(serve_fd, IO_READ, serve_accept, NULL);
+	io_loop_run(ioloop);
+	io_remove(&io_listen);
+
+	lib_signals_deinit();
+	io_loop_destroy(&ioloop);
+}
+
+/* Build all the replies once, so the server processes only copy them. */
+static void serve_replies_init(void)
+{
+	static const char *headers =
+		"From: sender@example.com\r\n"
+		"To: user@example.com\r\n"
+		"Subject: pop3test message\r\n"
+		"Message-ID: <pop3test@example.com>\r\n"
+		"\r\n";
+	string_t *msg;
+	unsigned int i;
+	size_t size;
+
+	msg = str_new(default_pool, serve_message_size + 128);
+	str_append(msg, headers);
+	while (str_len(msg) < serve_message_size) {
+		/* the lines never begin with '.', so no dot-stuffing */
+		str_append(msg, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+			   "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+	}
+	size = str_len(msg);
+	serve_retr_size = size;
+
+	serve_retr = str_new(default_pool, size + 64);
+	str_printfa(serve_retr, "+OK %zu octets\r\n", size);
+	str_append_n(serve_retr, str_data(msg), size);
+	str_append(serve_retr, ".\r\n");
+	str_free(&msg);
+
+	serve_top = str_new(default_pool, 256);
+	str_append(serve_top, "+OK\r\n");
+	str_append(serve_top, headers);
+	str_append(serve_top, ".\r\n");
+
+	serve_list = str_new(default_pool, 32 + serve_messages * 16);
+	serve_uidl = str_new(default_pool, 32 + serve_messages * 16);
+	str_printfa(serve_list, "+OK %u messages\r\n", serve_messages);
+	str_append(serve_uidl, "+OK\r\n");
+	for (i = 1; i <= serve_messages; i++) {
+		str_printfa(serve_list, "%u %zu\r\n", i, size);
+		str_printfa(serve_uidl, "%u uid%u\r\n", i, i);
+	}
+	str_append(serve_list, ".\r\n");
+	str_append(serve_uidl, ".\r\n");
+
+	serve_stat = i_strdup_printf("+OK %u %llu\r\n", serve_messages,
+				     (unsigned long long)size * serve_messages);
+}
+
+static void serve_replies_deinit(void)
+{
+	str_free(&serve_retr);
+	str_free(&serve_top);
+	str_free(&serve_list);
+	str_free(&serve_uidl);
+	i_free(serve_stat);
+}
+
+static void serve_start(void)
+{
+	in_port_t listen_port = port;
+	unsigned int i;
+	pid_t pid;
+
+	if (protocol != CLIENT_PROTOCOL_POP3)
+		i_fatal("--serve supports only POP3");
+	if (ssl_mode != SSL_MODE_NONE)
+		i_fatal("--serve doesn't support TLS");
+	if (hosts_count != 1)
+		i_fatal("--serve needs a single --host to listen on");
+
+	serve_replies_init();
+	serve_fd = net_listen(&hosts[0], &listen_port, 1024);
+	if (serve_fd == -1) {
+		i_fatal("net_listen(%s, %u) failed: %m",
+			net_ip2addr(&hosts[0]), port);
+	}
+	/* with port 0 the kernel picked one */
+	port = listen_port;
+
+	serve_pids = i_new(pid_t, serve_count);
+	for (i = 0; i < serve_count; i++) {
+		pid = fork();
+		if (pid < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			if (metrics_fd != -1)
+				i_close_fd(&metrics_fd);
+			serve_run();
+			lib_deinit();
+			exit(0);
+		}
+		serve_pids[i] = pid;
+	}
+	/* the clients don't need the listener */
+	i_close_fd(&serve_fd);
+}
+
+static void serve_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < serve_count; i++)
+		(void)kill(serve_pids[i], SIGTERM);
+	for (i = 0; i < serve_count; i++)
+		(void)waitpid(serve_pids[i], NULL, 0);
+	i_free(serve_pids);
+	serve_replies_deinit();
+}
+
+static const char *cpu_model_get(void)
+{
+	char buf[1024];
+	const char *model = "unknown";
+	FILE *f;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (f == NULL)
+		return model;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		if (strncmp(buf, "model name", 10) == 0 &&
+		    strchr(buf, ':') != NULL) {
+			buf[strcspn(buf, "\n")] = '\0';
+			model = t_strdup(strchr(buf, ':') + 2);
+			break;
+		}
+	}
+	fclose(f);
+	return model;
+}
+
+static bool arg_is_manifest_option(const char *arg)
+{
+	return strcmp(arg, "--manifest") == 0 ||
+		strncmp(arg, "--manifest=", 11) == 0;
+}
+
+/* Returns the file's SHA-256 in hex and its size. */
+static const char *file_digest(const char *path, uoff_t *size_r)
+{
+	unsigned char buf[IO_BLOCK_SIZE], digest[SHA256_RESULTLEN];
+	struct sha256_ctx ctx;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	sha256_init(&ctx);
+	*size_r = 0;
+	while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+		sha256_loop(&ctx, buf, ret);
+		*size_r += ret;
+	}
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	sha256_result(&ctx, digest);
+	return binary_to_hex(digest, sizeof(digest));
+}
+
+static void manifest_write_file(FILE *f, const char *path)
+{
+	const char *digest;
+	uoff_t size;
+
+	digest = file_digest(path, &size);
+	fprintf(f, "file\t%llu\t%s\t%s\n",
+		(unsigned long long)size, digest, path);
+}
+
+/* Write everything needed to repeat the run to the manifest. The input
+   files are recorded with their size and hash, so a replay can tell if
+   they've changed. The password file isn't, so its hash doesn't leak. */
+static void manifest_write(int argc, char *argv[], const char *users_path,
+			   const char *scenario_path)
+{
+	const struct rawlog_file *file;
+	struct utsname uts;
+	char hostname[256];
+	FILE *f;
+	int i;
+
+	f = fopen(manifest_path, "w");
+	if (f == NULL)
+		i_fatal("fopen(%s) failed: %m", manifest_path);
+	if (uname(&uts) < 0)
+		i_fatal("uname() failed: %m");
+	if (gethostname(hostname, sizeof(hostname)) < 0)
+		i_strocpy(hostname, "unknown", sizeof(hostname));
+
+	fprintf(f, MANIFEST_HEADER"\n"
+		"revision\t%s\n"
+		"dovecot\t%s\n"
+		"time\t%ld\n"
+		"hostname\t%s\n"
+		"kernel\t%s %s %s %s\n"
+		"cpu\t%s\n"
+		"cpus\t%ld\n"
+		"seed\t%llu\n",
+		POP3TEST_REVISION, DOVECOT_VERSION_FULL, (long)time(NULL),
+		hostname, uts.sysname, uts.release, uts.version, uts.machine,
+		cpu_model_get(), sysconf(_SC_NPROCESSORS_ONLN),
+		(unsigned long long)seed);
+	for (i = 1; i < argc; i++) {
+		if (arg_is_manifest_option(argv[i])) {
+			if (strchr(argv[i], '=') == NULL)
+				i++;
+			continue;
+		}
+		fprintf(f, "arg\t%s\n", argv[i]);
+	}
+	if (users_path != NULL)
+		manifest_write_file(f, users_path);
+	if (scenario_path != NULL)
+		manifest_write_file(f, scenario_path);
+	if (array_is_created(&rawlog_files)) {
+		array_foreach(&rawlog_files, file)
+			manifest_write_file(f, file->path);
+	}
+	if (fclose(f) < 0)
+		i_fatal("fclose(%s) failed: %m", manifest_path);
+}
+
+/* Build the command line to replay a manifest: the recorded arguments
+   followed by --seed <recorded seed>. The input files are remembered for
+   manifest_files_verify(). */
+static char **manifest_read_args(const char *path, int *argc_r)
+{
+	char buf[8192], **args = NULL, *value;
+	unsigned int count = 0, alloc_count = 0;
+	const char *seed_str = NULL;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		i_fatal("fopen(%s) failed: %m", path);
+	if (fgets(buf, sizeof(buf), f) == NULL ||
+	    strncmp(buf, MANIFEST_HEADER"\n", strlen(MANIFEST_HEADER) + 1) != 0)
+		i_fatal("%s: Not a pop3test manifest", path);
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+		value = strchr(buf, '\t');
+		if (value == NULL)
+			continue;
+		*value++ = '\0';
+		if (strcmp(buf, "seed") == 0)
+			seed_str = i_strdup(value);
+		else if (strcmp(buf, "file") == 0) {
+			replay_files = i_realloc(replay_files,
+				sizeof(*replay_files) * replay_files_count,
+				sizeof(*replay_files) *
+				(replay_files_count + 1));
+			replay_files[replay_files_count++] = i_strdup(value);
+		} else if (strcmp(buf, "arg") == 0) {
+			/* +1 for argv[0], +3 for --seed <n> NULL */
+			if (count + 4 >= alloc_count) {
+				alloc_count = alloc_count == 0 ? 32 :
+					alloc_count * 2;
+				args = i_realloc(args, sizeof(*args) * count,
+						 sizeof(*args) * alloc_count);
+			}
+			args[++count] = i_strdup(value);
+		}
+	}
+	fclose(f);
+	if (seed_str == NULL)
+		i_fatal("%s: Missing seed", path);
+	if (args == NULL)
+		args = i_new(char *, 4);
+
+	args[0] = "pop3test";
+	args[++count] = "--seed";
+	args[++count] = (char *)seed_str;
+	args[++count] = NULL;
+	*argc_r = count;
+	return args;
+}
+
+/* Make sure the replayed manifest's input files haven't changed */
+static void manifest_files_verify(void)
+{
+	const char *const *fields, *digest;
+	uint64_t size;
+	uoff_t cur_size;
+	unsigned int i;
+
+	for (i = 0; i < replay_files_count; i++) T_BEGIN {
+		fields = t_strsplit(replay_files[i], "\t");
+		if (str_array_length(fields) != 3 ||
+		    str_to_uint64(fields[0], &size) < 0)
+			i_fatal("Invalid manifest file: %s", replay_files[i]);
+		digest = file_digest(fields[2], &cur_size);
+		if (cur_size != size || strcmp(digest, fields[1]) != 0) {
+			i_fatal("%s has changed since the manifest was written "
+				"(size %llu, was %llu)", fields[2],
+				(unsigned long long)cur_size,
+				(unsigned long long)size);
+		}
+		i_free(replay_files[i]);
+	} T_END;
+	i_free(replay_files);
+	replay_files_count = 0;
+}
+
+static void ATTR_NORETURN usage(void)
+{
+	fprintf(stderr,
+"Usage: pop3test [options]\n"
+"       pop3test --replay <manifest>\n"
+"  -x, --protocol pop3|imap    Protocol to test (pop3)\n"
+"  -H, --host <ip>[,<ip>...]   Server IPs, used round-robin (%s)\n"
+"  -p, --port <port>           Server port (%u, or %u with --ssl;\n"
+"                              %u/%u for IMAP)\n"
+"  -c, --clients <n>           Concurrent sessions in closed loop mode (%u)\n"
+"  -d, --duration <secs>       Steady state length (0 = until killed)\n"
+"      --ramp-up <secs>        Grow the load from zero during this time\n"
+"      --ramp-down <secs>      Shrink the load to zero after --duration\n"
+"      --drain-timeout <secs>  Max time to wait for the running sessions\n"
+"                              at the end (%u)\n"
+"  -t, --threads <n>           Number of worker processes (1)\n"
+"  -r, --rate <sessions/s>     Open loop mode: start sessions at this rate\n"
+"  -a, --arrival <type>        poisson or constant arrivals (poisson)\n"
+"  -m, --max-sessions <n>      Open loop concurrency limit per worker (%u)\n"
+"  -u, --user-template <fmt>   Username with up to two %%u (%s)\n"
+"      --users <n>[-<m>]       Range for the first %%u (%s)\n"
+"      --domains <n>[-<m>]     Range for the second %%u (%s)\n"
+"  -f, --users-file <path>     File with \"username[:password]\" lines\n"
+"  -P, --password <password>   Password for all users (%s)\n"
+"      --password-file <path>  Read the password from the file\n"
+"      --retr-probability <p>  Probability of RETRing (or FETCHing) each\n"
+"                              message (1.0)\n"
+"      --dele-probability <p>  Probability of DELEing (or expunging) each\n"
+"                              message (0.5)\n"
+"  -s, --scenario <path>       Weighted command scenarios, see the top of\n"
+"                              pop3test.c for the format\n"
+"      --engine ioloop|io_uring\n"
+"                              Connection engine (ioloop), io_uring runs\n"
+"                              only plaintext POP3 logins\n"
+"      --rawlog <dir>          Replay captured rawlog *.in sessions\n"
+"      --rawlog-scale <x>      Multiply the captured delays (1, 0 = none)\n"
+"      --pipeline-depth <n>    Max TOP/RETR/DELE commands waiting for a\n"
+"                              reply (0 = unlimited, 1 = lockstep) (0)\n"
+"  -S, --ssl                   Use POP3S/IMAPS\n"
+"      --starttls              Use STLS/STARTTLS\n"
+"      --ssl-tickets yes|no    Allow TLS session tickets (yes)\n"
+"      --ssl-resume            Try to resume the previous TLS session\n"
+"      --seed <n>              Random seed (based on the time)\n"
+"      --manifest <path>       Write the run's parameters, environment and\n"
+"                              input file hashes\n"
+"      --progress <secs>       Progress line to stderr every n seconds\n"
+"                              (1, 0 = disabled)\n"
+"      --serve <n>             Run a mock POP3 server in n processes and\n"
+"                              test against it\n"
+"      --serve-messages <n>    Mock mailbox's message count (%u)\n"
+"      --serve-message-size <bytes>\n"
+"                              Mock mailbox's message size (%u)\n"
+"      --metrics [<ip>:]<port>|<path>\n"
+"                              Serve Prometheus metrics over HTTP or on a\n"
+"                              unix socket\n",
+		DEFAULT_HOST, DEFAULT_PORT, DEFAULT_SSL_PORT,
+		DEFAULT_IMAP_PORT, DEFAULT_IMAPS_PORT,
+		DEFAULT_CLIENTS_COUNT, DEFAULT_DRAIN_TIMEOUT_SECS, max_sessions,
+		DEFAULT_USERNAME_TEMPLATE, DEFAULT_USER_RANGE,
+		DEFAULT_DOMAIN_RANGE, DEFAULT_PASSWORD,
+		DEFAULT_SERVE_MESSAGES, DEFAULT_SERVE_MESSAGE_SIZE);
+	exit(1);
+}
+
+static void hosts_parse(const char *str)
+{
+	const char *const *list;
+	unsigned int i;
+
+	list = t_strsplit(str, ",");
+	for (hosts_count = 0; list[hosts_count] != NULL; hosts_count++) ;
+	hosts = i_new(struct ip_addr, hosts_count);
+	for (i = 0; i < hosts_count; i++) {
+		if (net_addr2ip(list[i], &hosts[i]) < 0)
+			i_fatal("Invalid host IP: %s", list[i]);
+	}
+}
+
+static void user_range_parse(const char *str, struct user_range *range_r)
+{
+	unsigned int first, last;
+	char *end;
+
+	first = last = strtoul(str, &end, 10);
+	if (*end == '-')
+		last = strtoul(end + 1, &end, 10);
+	if (*end != '\0' || end == str || last < first)
+		i_fatal("Invalid range: %s", str);
+	range_r->first = first;
+	range_r->count = last - first + 1;
+}
+
+/* The template is user-given printf format, so make sure it can't be used
+   to do anything else than print two unsigned ints. */
+static void user_template_verify(const char *tmpl)
+{
+	unsigned int count = 0;
+	const char *p;
+
+	for (p = tmpl; *p != '\0'; p++) {
+		if (*p != '%')
+			continue;
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+		for (p++; *p >= '0' && *p <= '9'; p++) ;
+		if (*p != 'u' || ++count > 2) {
+			i_fatal("Invalid --user-template %s: "
+				"Only up to two %%u are allowed", tmpl);
+		}
+	}
+}
+
+static double probability_parse(const char *str)
+{
+	double value;
+	char *end;
+
+	value = strtod(str, &end);
+	if (*end != '\0' || end == str || value < 0 || value > 1)
+		i_fatal("Invalid probability: %s", str);
+	return value;
+}
+
+static const char *password_file_read(const char *path)
+{
+	char buf[1024];
+	size_t len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		i_fatal("fopen(%s) failed: %m", path);
+	if (fgets(buf, sizeof(buf), f) == NULL)
+		i_fatal("%s: Empty password file", path);
+	fclose(f);
+
+	len = strcspn(buf, "\r\n");
+	return i_strndup(buf, len);
+}
+
+static void users_file_parse(const char *path)
+{
+	const char *p, *end, *line_end, *sep;
+	struct stat st;
+	unsigned int alloc_count = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (st.st_size == 0)
+		i_fatal("%s: Empty users file", path);
+
+	users_map_size = st.st_size;
+	users_map = mmap(NULL, users_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (users_map == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", path);
+	(void)close(fd);
+
+	p = users_map;
+	end = p + users_map_size;
+	for (; p < end; p = line_end + 1) {
+		line_end = memchr(p, '\n', end - p);
+		if (line_end == NULL)
+			line_end = end;
+		if (p == line_end || *p == '#' || *p == '\r')
+			continue;
+
+		if (users_count == alloc_count) {
+			alloc_count = alloc_count == 0 ? 1024 : alloc_count * 2;
+			users = i_realloc(users,
+					  sizeof(*users) * users_count,
+					  sizeof(*users) * alloc_count);
+		}
+		sep = memchr(p, ':', line_end - p);
+		users[users_count].username = p;
+		users[users_count].username_len =
+			(sep != NULL ? sep : line_end) - p;
+		if (sep != NULL) {
+			users[users_count].password = sep + 1;
+			users[users_count].password_len = line_end - (sep + 1);
+			if (users[users_count].password_len > 0 &&
+			    line_end[-1] == '\r')
+				users[users_count].password_len--;
+		} else if (users[users_count].username_len > 0 &&
+			   line_end[-1] == '\r') {
+			users[users_count].username_len--;
+		}
+		users_count++;
+	}
+	if (users_count == 0)
+		i_fatal("%s: No users found", path);
+}
+
+static const char *
+scenario_step_select_parse(const char *str, struct scenario_step *step_r)
+{
+	char *end;
+
+	if (strcmp(str, "all") == 0)
+		step_r->select = STEP_SELECT_ALL;
+	else if (strcmp(str, "first") == 0)
+		step_r->select = STEP_SELECT_FIRST;
+	else if (strcmp(str, "last") == 0)
+		step_r->select = STEP_SELECT_LAST;
+	else {
+		step_r->select = STEP_SELECT_RANDOM;
+		step_r->probability = strtod(str, &end);
+		if (*end != '\0' || end == str ||
+		    step_r->probability < 0 || step_r->probability > 1)
+			return t_strdup_printf("Invalid messages: %s", str);
+	}
+	return NULL;
+}
+
+static const char *
+scenario_step_parse(const char *str, struct scenario_step *step_r,
+		    const char **arg_r)
+{
+	const char *const *args = t_strsplit(str, ":");
+	unsigned int i, *num_r;
+	const char *error;
+	char *end;
+
+	memset(step_r, 0, sizeof(*step_r));
+	*arg_r = NULL;
+	for (i = 0; i < CLIENT_CMD_COUNT; i++) {
+		if (client_commands[i].protocol == protocol &&
+		    !COMMAND_HAS_FLAG(i, COMMAND_FLAG_IMPLICIT) &&
+		    strcasecmp(args[0], client_commands[i].name) == 0)
+			break;
+	}
+	if (i == CLIENT_CMD_COUNT)
+		return t_strdup_printf("Unknown command: %s", args[0]);
+	step_r->cmd = i;
+
+	switch (step_r->cmd) {
+	case IMAP_CMD_SELECT:
+		*arg_r = "INBOX";
+		break;
+	case IMAP_CMD_FETCH:
+		*arg_r = "BODY.PEEK[]";
+		break;
+	case IMAP_CMD_STORE:
+		*arg_r = "+\\Seen";
+		break;
+	case IMAP_CMD_SEARCH:
+		*arg_r = "ALL";
+		break;
+	case IMAP_CMD_IDLE:
+		step_r->idle_secs = DEFAULT_IDLE_SECS;
+		break;
+	default:
+		break;
+	}
+
+	if (args[1] != NULL &&
+	    COMMAND_HAS_FLAG(step_r->cmd, COMMAND_FLAG_PER_MESSAGE)) {
+		error = scenario_step_select_parse(args[1], step_r);
+		if (error != NULL)
+			return error;
+		args++;
+	}
+	if (args[1] == NULL)
+		return NULL;
+
+	if (*arg_r != NULL) {
+		/* the rest may contain ':', e.g. sequence sets */
+		*arg_r = t_str_replace(t_strarray_join(args + 1, ":"),
+				       ',', ' ');
+		return NULL;
+	}
+	if (args[2] != NULL)
+		return t_strdup_printf("Too many parameters: %s", str);
+	if (step_r->cmd == POP3_CMD_TOP)
+		num_r = &step_r->top_lines;
+	else if (step_r->cmd == IMAP_CMD_IDLE)
+		num_r = &step_r->idle_secs;
+	else
+		return t_strdup_printf("%s doesn't take parameters",
+				       client_commands[step_r->cmd].name);
+	*num_r = strtoul(args[1], &end, 10);
+	if (*end != '\0' || end == args[1])
+		return t_strdup_printf("Invalid number: %s", args[1]);
+	return NULL;
+}
+
+static const char *scenario_parse(const char *line)
+{
+	const char *const *args = t_strsplit_spaces(line, " \t");
+	struct scenario *scenario;
+	struct scenario_step *step;
+	unsigned int i, count, weight;
+	bool have_messages = FALSE;
+	const char *error, *arg;
+	char *end;
+
+	count = str_array_length(args);
+	if (count < 3)
+		return "Expected: <weight> <name> <command> [<command>...]";
+	if (scenarios_count == MAX_SCENARIOS)
+		return t_strdup_printf("Too many scenarios (max %u)",
+				       MAX_SCENARIOS);
+	weight = strtoul(args[0], &end, 10);
+	if (*end != '\0' || weight == 0)
+		return t_strdup_printf("Invalid weight: %s", args[0]);
+
+	scenario = &scenarios[scenarios_count];
+	scenario->name = i_strdup(args[1]);
+	scenario->weight = weight;
+	/* banner, STLS, USER, PASS, <commands>, QUIT */
+	scenario->steps = i_new(struct scenario_step, count - 2 + 5);
+
+	step = scenario->steps;
+	if (protocol == CLIENT_PROTOCOL_POP3) {
+		(step++)->cmd = POP3_CMD_BANNER;
+		if (ssl_mode == SSL_MODE_STARTTLS)
+			(step++)->cmd = POP3_CMD_STLS;
+		(step++)->cmd = POP3_CMD_USER;
+		(step++)->cmd = POP3_CMD_PASS;
+	} else {
+		(step++)->cmd = IMAP_CMD_BANNER;
+		if (ssl_mode == SSL_MODE_STARTTLS)
+			(step++)->cmd = IMAP_CMD_STARTTLS;
+		(step++)->cmd = IMAP_CMD_LOGIN;
+	}
+	for (i = 2; i < count; i++, step++) {
+		error = scenario_step_parse(args[i], step, &arg);
+		if (error != NULL)
+			return error;
+		step->arg = i_strdup(arg);
+		if (COMMAND_HAS_FLAG(step->cmd, COMMAND_FLAG_COUNTS_MESSAGES))
+			have_messages = TRUE;
+		else if (COMMAND_HAS_FLAG(step->cmd,
+					  COMMAND_FLAG_PER_MESSAGE) &&
+			 !have_messages) {
+			return t_strdup_printf("%s needs %s before it",
+				client_commands[step->cmd].name,
+				protocol == CLIENT_PROTOCOL_POP3 ?
+				"STAT, LIST or UIDL" : "SELECT");
+		}
+	}
+	(step++)->cmd = protocol == CLIENT_PROTOCOL_POP3 ?
+		POP3_CMD_QUIT : IMAP_CMD_LOGOUT;
+	scenario->steps_count = step - scenario->steps;
+
+	scenarios_count++;
+	scenarios_total_weight += weight;
+	return NULL;
+}
+
+static void scenarios_read(const char *path)
+{
+	char buf[4096];
+	const char *error;
+	unsigned int linenum = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		i_fatal("fopen(%s) failed: %m", path);
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		linenum++;
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (buf[strspn(buf, " \t")] == '\0' || buf[0] == '#')
+			continue;
+		T_BEGIN {
+			error = scenario_parse(buf);
+			if (error != NULL)
+				i_fatal("%s line %u: %s", path, linenum, error);
+		} T_END;
+	}
+	fclose(f);
+	if (scenarios_count == 0)
+		i_fatal("%s: No scenarios", path);
+}
+
+static void scenarios_free(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < scenarios_count; i++) {
+		for (j = 0; j < scenarios[i].steps_count; j++)
+			i_free(scenarios[i].steps[j].arg);
+		i_free(scenarios[i].name);
+		i_free(scenarios[i].steps);
+		i_free(scenarios[i].username);
+	}
+}
+
+/* Parse an optional "<secs>.<usecs> " rawlog timestamp prefix. */
+static const char *
+rawlog_line_timestamp(const char *p, const char *end, uint64_t *usecs_r)
+{
+	const char *start = p;
+	uint64_t secs = 0, usecs = 0;
+	unsigned int digits = 0;
+
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		secs = secs * 10 + (*p - '0');
+	if (p == start || p == end || *p != '.')
+		return start;
+	for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		usecs = usecs * 10 + (*p - '0');
+	if (digits != 6 || p == end || *p != ' ')
+		return start;
+	*usecs_r = secs * 1000000 + usecs;
+	return p + 1;
+}
+
+static enum client_cmd rawlog_line_cmd(const char *line, unsigned int len,
+				       bool *single_line_r)
+{
+	const char *sp = memchr(line, ' ', len);
+	unsigned int i, name_len = sp == NULL ? len : (unsigned int)(sp - line);
+
+	for (i = POP3_CMD_BANNER; i < POP3_CMD_OTHER; i++) {
+		const char *name = client_commands[i].name;
+
+		if (name != NULL && strlen(name) == name_len &&
+		    strncasecmp(line, name, name_len) == 0)
+			break;
+	}
+	*single_line_r = sp != NULL &&
+		(i == POP3_CMD_LIST || i == POP3_CMD_UIDL);
+	return i;
+}
+
+static void rawlog_file_index(const char *path, const char *username)
+{
+	struct rawlog_file *file;
+	struct scenario *session;
+	struct scenario_step *step;
+	const char *p, *end, *line, *line_end;
+	uint64_t usecs, prev_usecs = 0;
+	unsigned int len, lines = 0, alloc_count;
+	bool skip_next = FALSE, have_quit = FALSE;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (st.st_size == 0) {
+		(void)close(fd);
+		return;
+	}
+	file = array_append_space(&rawlog_files);
+	file->path = i_strdup(path);
+	file->size = st.st_size;
+	file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file->map == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", path);
+	(void)close(fd);
+
+	p = file->map;
+	end = p + file->size;
+	for (; p < end; p++) {
+		if (*p == '\n')
+			lines++;
+	}
+
+	if (rawlog_sessions_count % 64 == 0) {
+		rawlog_sessions = i_realloc(rawlog_sessions,
+			sizeof(*rawlog_sessions) * rawlog_sessions_count,
+			sizeof(*rawlog_sessions) *
+			(rawlog_sessions_count + 64));
+	}
+	session = &rawlog_sessions[rawlog_sessions_count++];
+	session->name = i_strdup(path);
+	session->username = i_strdup(username);
+	/* banner, STLS, USER, PASS, <lines>, QUIT */
+	alloc_count = lines + 1 + 5;
+	session->steps = i_new(struct scenario_step, alloc_count);
+	step = session->steps;
+	(step++)->cmd = POP3_CMD_BANNER;
+	if (ssl_mode == SSL_MODE_STARTTLS)
+		(step++)->cmd = POP3_CMD_STLS;
+	(step++)->cmd = POP3_CMD_USER;
+	(step++)->cmd = POP3_CMD_PASS;
+
+	for (p = file->map; p < end && !have_quit; p = line_end + 1) {
+		line_end = memchr(p, '\n', end - p);
+		if (line_end == NULL)
+			line_end = end;
+		usecs = prev_usecs;
+		line = rawlog_line_timestamp(p, line_end, &usecs);
+		len = line_end - line;
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		if (len == 0)
+			continue;
+		if (skip_next) {
+			/* SASL response to AUTH */
+			skip_next = FALSE;
+			continue;
+		}
+
+		if (len > 5 && strncasecmp(line, "USER ", 5) == 0) {
+			i_free(session->username);
+			session->username = i_strndup(line + 5, len - 5);
+			continue;
+		}
+		if (len >= 4 && (strncasecmp(line, "PASS", 4) == 0 ||
+				 strncasecmp(line, "STLS", 4) == 0 ||
+				 strncasecmp(line, "APOP", 4) == 0))
+			continue;
+		if (len >= 4 && strncasecmp(line, "AUTH", 4) == 0) {
+			/* "AUTH <mech>" without an initial response is
+			   followed by the response line. A bare "AUTH" only
+			   lists the mechanisms. */
+			skip_next = len > 5 && line[4] == ' ' &&
+				memchr(line + 5, ' ', len - 5) == NULL;
+			continue;
+		}
+
+		step->raw_line = line;
+		step->raw_line_len = len;
+		step->cmd = rawlog_line_cmd(line, len, &step->single_line);
+		if (prev_usecs != 0 && usecs > prev_usecs)
+			step->delay_usecs = usecs - prev_usecs;
+		prev_usecs = usecs;
+		have_quit = step->cmd == POP3_CMD_QUIT;
+		step++;
+	}
+	if (!have_quit)
+		(step++)->cmd = POP3_CMD_QUIT;
+	session->steps_count = step - session->steps;
+	i_assert(session->steps_count <= alloc_count);
+}
+
+static bool rawlog_is_in_file(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 3 && strcmp(name + len - 3, ".in") == 0;
+}
+
+/* Index the *.in files in dir and its user subdirectories */
+static void rawlog_dir_scan(const char *dir, const char *username)
+{
+	struct dirent *d;
+	struct stat st;
+	const char *path;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	while ((d = readdir(dirp)) != NULL) T_BEGIN {
+		if (d->d_name[0] == '.')
+			;
+		else {
+			path = t_strconcat(dir, "/", d->d_name, NULL);
+			if (stat(path, &st) < 0)
+				i_fatal("stat(%s) failed: %m", path);
+			if (S_ISDIR(st.st_mode) && username == NULL)
+				rawlog_dir_scan(path, d->d_name);
+			else if (S_ISREG(st.st_mode) &&
+				 rawlog_is_in_file(d->d_name))
+				rawlog_file_index(path, username);
+		}
+	} T_END;
+	if (closedir(dirp) < 0)
+		i_error("closedir(%s) failed: %m", dir);
+}
+
+static void rawlog_read(const char *dir)
+{
+	if (protocol != CLIENT_PROTOCOL_POP3)
+		i_fatal("--rawlog supports only POP3");
+	i_array_init(&rawlog_files, 64);
+	rawlog_dir_scan(dir, NULL);
+	if (rawlog_sessions_count == 0)
+		i_fatal("%s: No rawlog *.in files found", dir);
+
+	/* all sessions are reported as a single scenario */
+	scenarios[0].name = i_strdup("rawlog");
+	scenarios[0].weight = 1;
+	scenarios_count = 1;
+	scenarios_total_weight = 1;
+}
+
+static void rawlog_free(void)
+{
+	struct rawlog_file *file;
+	unsigned int i;
+
+	if (!array_is_created(&rawlog_files))
+		return;
+	for (i = 0; i < rawlog_sessions_count; i++) {
+		i_free(rawlog_sessions[i].name);
+		i_free(rawlog_sessions[i].username);
+		i_free(rawlog_sessions[i].steps);
+	}
+	i_free(rawlog_sessions);
+	array_foreach_modifiable(&rawlog_files, file) {
+		(void)munmap(file->map, file->size);
+		i_free(file->path);
+	}
+	array_free(&rawlog_files);
+}
+
+int main(int argc, char *argv[])
+{
+	enum {
+		OPT_USERS = 256,
+		OPT_DOMAINS,
+		OPT_PASSWORD_FILE,
+		OPT_RETR_PROBABILITY,
+		OPT_DELE_PROBABILITY,
+		OPT_STARTTLS,
+		OPT_SSL_TICKETS,
+		OPT_SSL_RESUME,
+		OPT_PIPELINE_DEPTH,
+		OPT_PROGRESS,
+		OPT_METRICS,
+		OPT_SERVE,
+		OPT_SERVE_MESSAGES,
+		OPT_SERVE_MESSAGE_SIZE,
+		OPT_SEED,
+		OPT_MANIFEST,
+		OPT_RAMP_UP,
+		OPT_RAMP_DOWN,
+		OPT_DRAIN_TIMEOUT,
+		OPT_RAWLOG,
+		OPT_RAWLOG_SCALE,
+		OPT_ENGINE
+	};
+	static const struct option longopts[] = {
+		{ "protocol", required_argument, NULL, 'x' },
+		{ "host", required_argument, NULL, 'H' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "clients", required_argument, NULL, 'c' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "ramp-up", required_argument, NULL, OPT_RAMP_UP },
+		{ "ramp-down", required_argument, NULL, OPT_RAMP_DOWN },
+		{ "drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT },
+		{ "threads", required_argument, NULL, 't' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "arrival", required_argument, NULL, 'a' },
+		{ "max-sessions", required_argument, NULL, 'm' },
+		{ "user-template", required_argument, NULL, 'u' },
+		{ "users", required_argument, NULL, OPT_USERS },
+		{ "domains", required_argument, NULL, OPT_DOMAINS },
+		{ "users-file", required_argument, NULL, 'f' },
+		{ "password", required_argument, NULL, 'P' },
+		{ "password-file", required_argument, NULL, OPT_PASSWORD_FILE },
+		{ "retr-probability", required_argument, NULL,
+		  OPT_RETR_PROBABILITY },
+		{ "dele-probability", required_argument, NULL,
+		  OPT_DELE_PROBABILITY },
+		{ "scenario", required_argument, NULL, 's' },
+		{ "rawlog", required_argument, NULL, OPT_RAWLOG },
+		{ "rawlog-scale", required_argument, NULL, OPT_RAWLOG_SCALE },
+		{ "engine", required_argument, NULL, OPT_ENGINE },
+		{ "pipeline-depth", required_argument, NULL,
+		  OPT_PIPELINE_DEPTH },
+		{ "ssl", no_argument, NULL, 'S' },
+		{ "starttls", no_argument, NULL, OPT_STARTTLS },
+		{ "ssl-tickets", required_argument, NULL, OPT_SSL_TICKETS },
+		{ "ssl-resume", no_argument, NULL, OPT_SSL_RESUME },
+		{ "progress", required_argument, NULL, OPT_PROGRESS },
+		{ "metrics", required_argument, NULL, OPT_METRICS },
+		{ "seed", required_argument, NULL, OPT_SEED },
+		{ "manifest", required_argument, NULL, OPT_MANIFEST },
+		{ "serve", required_argument, NULL, OPT_SERVE },
+		{ "serve-messages", required_argument, NULL,
+		  OPT_SERVE_MESSAGES },
+		{ "serve-message-size", required_argument, NULL,
+		  OPT_SERVE_MESSAGE_SIZE },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *host = DEFAULT_HOST, *users_path = NULL;
+	const char *users_range_str = DEFAULT_USER_RANGE;
+	const char *domains_range_str = DEFAULT_DOMAIN_RANGE;
+	const char *password_path = NULL, *scenario_path = NULL;
+	const char *rawlog_path = NULL;
+	const char *error;
+	char *end;
+	int c;
+
+	if (argc == 3 && strcmp(argv[1], "--replay") == 0)
+		argv = manifest_read_args(argv[2], &argc);
+
+	while ((c = getopt_long(argc, argv, "x:H:p:c:d:t:r:a:m:u:f:P:s:S",
+				longopts, NULL)) != -1) {
+		switch (c) {
+		case 'x':
+			if (strcmp(optarg, "pop3") == 0)
+				protocol = CLIENT_PROTOCOL_POP3;
+			else if (strcmp(optarg, "imap") == 0)
+				protocol = CLIENT_PROTOCOL_IMAP;
+			else
+				usage();
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			if (str_to_uint(optarg, &port) < 0 ||
+			    port == 0 || port > 65535)
+				usage();
+			break;
+		case 'c':
+			if (str_to_uint(optarg, &total_clients_count) < 0 ||
+			    total_clients_count == 0)
+				usage();
+			break;
+		case 'd':
+			if (str_to_uint(optarg, &duration_secs) < 0)
+				usage();
+			break;
+		case 't':
+			if (str_to_uint(optarg, &workers_count) < 0 ||
+			    workers_count == 0)
+				usage();
+			break;
+		case 'r':
+			arrival_rate = strtod(optarg, NULL);
+			if (arrival_rate <= 0)
+				usage();
+			break;
+		case 'a':
+			if (strcmp(optarg, "poisson") == 0)
+				arrival_poisson = TRUE;
+			else if (strcmp(optarg, "constant") == 0)
+				arrival_poisson = FALSE;
+			else
+				usage();
+			break;
+		case 'm':
+			if (str_to_uint(optarg, &max_sessions) < 0 ||
+			    max_sessions == 0)
+				usage();
+			break;
+		case 'u':
+			username_template = optarg;
+			break;
+		case OPT_USERS:
+			users_range_str = optarg;
+			break;
+		case OPT_DOMAINS:
+			domains_range_str = optarg;
+			break;
+		case 'f':
+			users_path = optarg;
+			break;
+		case 'P':
+			password = optarg;
+			break;
+		case OPT_PASSWORD_FILE:
+			password_path = optarg;
+			break;
+		case OPT_RETR_PROBABILITY:
+			retr_probability = probability_parse(optarg);
+			break;
+		case OPT_DELE_PROBABILITY:
+			dele_probability = probability_parse(optarg);
+			break;
+		case 's':
+			scenario_path = optarg;
+			break;
+		case OPT_ENGINE:
+			if (strcmp(optarg, "ioloop") == 0)
+				engine = CLIENT_ENGINE_IOLOOP;
+			else if (strcmp(optarg, "io_uring") == 0) {
+#ifdef POP3TEST_IO_URING
+				engine = CLIENT_ENGINE_IO_URING;
+#else
+				i_fatal("io_uring support not compiled in");
+#endif
+			} else
+				usage();
+			break;
+		case OPT_RAWLOG:
+			rawlog_path = optarg;
+			break;
+		case OPT_RAWLOG_SCALE:
+			rawlog_scale = strtod(optarg, &end);
+			if (*end != '\0' || end == optarg || rawlog_scale < 0)
+				usage();
+			break;
+		case OPT_PIPELINE_DEPTH:
+			pipeline_depth = strtoul(optarg, &end, 10);
+			if (*end != '\0' || end == optarg)
+				usage();
+			break;
+		case 'S':
+			ssl_mode = SSL_MODE_IMMEDIATE;
+			break;
+		case OPT_STARTTLS:
+			ssl_mode = SSL_MODE_STARTTLS;
+			break;
+		case OPT_SSL_TICKETS:
+			if (strcmp(optarg, "yes") == 0)
+				ssl_tickets = TRUE;
+			else if (strcmp(optarg, "no") == 0)
+				ssl_tickets = FALSE;
+			else
+				usage();
+			break;
+		case OPT_SSL_RESUME:
+			ssl_resume = TRUE;
+			break;
+		case OPT_PROGRESS:
+			if (str_to_uint(optarg, &progress_secs) < 0)
+				usage();
+			break;
+		case OPT_METRICS:
+			metrics_path = optarg;
+			break;
+		case OPT_RAMP_UP:
+			if (str_to_uint(optarg, &ramp_up_secs) < 0)
+				usage();
+			break;
+		case OPT_RAMP_DOWN:
+			if (str_to_uint(optarg, &ramp_down_secs) < 0)
+				usage();
+			break;
+		case OPT_DRAIN_TIMEOUT:
+			if (str_to_uint(optarg, &drain_timeout_secs) < 0)
+				usage();
+			break;
+		case OPT_SEED:
+			if (str_to_uint64(optarg, &seed) < 0)
+				usage();
+			seed_set = TRUE;
+			break;
+		case OPT_MANIFEST:
+			manifest_path = optarg;
+			break;
+		case OPT_SERVE:
+			if (str_to_uint(optarg, &serve_count) < 0 ||
+			    serve_count == 0)
+				usage();
+			break;
+		case OPT_SERVE_MESSAGES:
+			if (str_to_uint(optarg, &serve_messages) < 0)
+				usage();
+			break;
+		case OPT_SERVE_MESSAGE_SIZE:
+			if (str_to_uint(optarg, &serve_message_size) < 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (port == 0 && serve_count > 0) {
+		/* let the kernel choose */
+	} else if (port == 0 && protocol == CLIENT_PROTOCOL_POP3) {
+		port = ssl_mode == SSL_MODE_IMMEDIATE ?
+			DEFAULT_SSL_PORT : DEFAULT_PORT;
+	} else if (port == 0) {
+		port = ssl_mode == SSL_MODE_IMMEDIATE ?
+			DEFAULT_IMAPS_PORT : DEFAULT_IMAP_PORT;
+	}
+
+	lib_init();
+
+	manifest_files_verify();
+	hosts_parse(host);
+	user_template_verify(username_template);
+	user_range_parse(users_range_str, &user_range);
+	user_range_parse(domains_range_str, &domain_range);
+	if (password_path != NULL)
+		password = password_file_read(password_path);
+	if (users_path != NULL)
+		users_file_parse(users_path);
+	if (metrics_path != NULL)
+		metrics_listen();
+	if (engine == CLIENT_ENGINE_IO_URING) {
+		if (protocol != CLIENT_PROTOCOL_POP3 ||
+		    ssl_mode != SSL_MODE_NONE)
+			i_fatal("--engine io_uring supports only "
+				"plaintext POP3");
+		if (scenario_path != NULL || rawlog_path != NULL)
+			i_fatal("--engine io_uring runs only logins, "
+				"it can't be used with --scenario or --rawlog");
+		/* reported as a single scenario */
+		scenarios[0].name = i_strdup("login");
+		scenarios[0].weight = 1;
+		scenarios_count = 1;
+		scenarios_total_weight = 1;
+	} else if (rawlog_path != NULL) {
+		if (scenario_path != NULL)
+			i_fatal("--rawlog and --scenario can't be used "
+				"together");
+		rawlog_read(rawlog_path);
+	} else if (scenario_path != NULL)
+		scenarios_read(scenario_path);
+	else if (protocol == CLIENT_PROTOCOL_POP3) {
+		error = scenario_parse(t_strdup_printf(
+			"1 default STAT RETR:%g DELE:%g",
+			retr_probability, dele_probability));
+		if (error != NULL)
+			i_unreached();
+	} else {
+		error = scenario_parse(t_strdup_printf(
+			"1 default SELECT FETCH:%g STORE:%g:\\Deleted EXPUNGE",
+			retr_probability, dele_probability));
+		if (error != NULL)
+			i_unreached();
+	}
+
+	worker_stats = mmap(NULL, sizeof(struct stats) * workers_count *
+			    RUN_PHASE_COUNT,
+			    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			    -1, 0);
+	if (worker_stats == MAP_FAILED)
+		i_fatal("mmap() failed: %m");
+
+	if (!seed_set)
+		seed = ((uint64_t)time(NULL) << 20) ^ getpid();
+	if (manifest_path != NULL)
+		manifest_write(argc, argv, users_path, scenario_path);
+	if (serve_count > 0)
+		serve_start();
+
+	run_start_usecs = clock_usecs();
+	if (workers_count == 1)
+		worker_run(0, total_clients_count);
+	else
+		workers_run(total_clients_count);
+	stats_print_total();
+	if (serve_count > 0)
+		serve_stop();
+
+	(void)munmap(worker_stats,
+		     sizeof(struct stats) * workers_count * RUN_PHASE_COUNT);
+	if (users_map != NULL) {
+		(void)munmap(users_map, users_map_size);
+		i_free(users);
+	}
+	if (metrics_fd != -1) {
+		i_close_fd(&metrics_fd);
+		if (!metrics_http)
+			(void)unlink(metrics_path);
+	}
+	rawlog_free();
+	scenarios_free();
+	i_free(hosts);
 	lib_deinit();
 	return 0;
 }